@@ -0,0 +1,315 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+
+static void init_clients(struct control *control, int epollfd)
+{
+        for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+                control->clients[i].fd = -1;
+                control->clients[i].len = 0;
+        }
+
+        control->epollfd = epollfd;
+}
+
+/* Start listening on fd, and have the event loop watch it. */
+static int watch_listener(struct control *control, int fd)
+{
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+        if (listen(fd, MAX_CONTROL_CLIENTS) || epoll_ctl(control->epollfd, EPOLL_CTL_ADD, fd, &ev)) {
+                int err = errno;
+
+                close(fd);
+                errno = err;
+                return -1;
+        }
+
+        control->fd = fd;
+
+        return 0;
+}
+
+/* Listen on a Unix socket at path. A socket left over from an unclean exit
+ * is removed first. */
+int open_control(struct control *control, const char *path, int epollfd, const struct control_handler *handler)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        struct stat st;
+        mode_t mask;
+        int fd, err;
+
+        init_clients(control, epollfd);
+        control->handler = *handler;
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+
+        strcpy(addr.sun_path, path);
+
+        if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+                unlink(path);
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -1;
+        }
+
+        /* Blocking hosts is root's business. The socket gets its mode when
+         * it's made, so there's no moment where anyone else could connect. */
+        mask = umask(0077);
+        err = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        umask(mask);
+
+        if (err) {
+                err = errno;
+                close(fd);
+                errno = err;
+                return -1;
+        }
+
+        if (watch_listener(control, fd)) {
+                err = errno;
+                unlink(path);
+                errno = err;
+                return -1;
+        }
+
+        control->path = path;
+
+        return 0;
+}
+
+/* Listen for Prometheus on localhost. Scrapes go through the same client
+ * table as the control socket, but they're answered by the caller, so
+ * there's no handler. */
+int open_metrics(struct control *metrics, long port, int epollfd)
+{
+        struct sockaddr_in addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(port),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        int one = 1;
+        int fd;
+
+        init_clients(metrics, epollfd);
+        metrics->path = NULL;
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -1;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+                int err = errno;
+
+                close(fd);
+                errno = err;
+                return -1;
+        }
+
+        return watch_listener(metrics, fd);
+}
+
+void accept_control(struct control *control)
+{
+        struct epoll_event ev = { .events = EPOLLIN };
+        int fd = accept(control->fd, NULL, NULL);
+
+        if (fd < 0) {
+                return;
+        }
+
+        if (fcntl(fd, F_SETFL, O_NONBLOCK)) {
+                close(fd);
+                return;
+        }
+
+        for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+                struct control_client *client = &control->clients[i];
+
+                if (client->fd >= 0) {
+                        continue;
+                }
+
+                ev.data.fd = fd;
+                if (epoll_ctl(control->epollfd, EPOLL_CTL_ADD, fd, &ev)) {
+                        break;
+                }
+
+                client->fd = fd;
+                client->len = 0;
+                return;
+        }
+
+        close(fd);
+}
+
+struct control_client *find_client(struct control *control, int fd)
+{
+        if (control->fd < 0) {
+                return NULL;
+        }
+
+        for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+                if (control->clients[i].fd == fd) {
+                        return &control->clients[i];
+                }
+        }
+
+        return NULL;
+}
+
+void drop_client(struct control_client *client)
+{
+        close(client->fd);
+        client->fd = -1;
+        client->len = 0;
+}
+
+/* Read what the client sent. Returns 1 if there's something new in its
+ * buffer, 0 if not, and drops the client if it's gone. */
+int read_client(struct control_client *client)
+{
+        ssize_t n = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len);
+
+        if (n < 0 && errno == EAGAIN) {
+                return 0;
+        }
+
+        if (n <= 0) {
+                drop_client(client);
+                return 0;
+        }
+
+        client->len += n;
+
+        return 1;
+}
+
+/* Read what the client sent and answer every complete request in it. Only
+ * ever one read per wakeup, so a chatty client can't starve the ring buffer. */
+void serve_control(struct control *control, struct control_client *client)
+{
+        const struct control_handler *handler = &control->handler;
+
+        if (!read_client(client)) {
+                return;
+        }
+
+        while (client->len) {
+                size_t used;
+                int err;
+
+                if (!client->buf[0]) {
+                        struct control_request req;
+
+                        if (client->len < sizeof(req)) {
+                                return;
+                        }
+
+                        memcpy(&req, client->buf, sizeof(req));
+                        used = sizeof(req);
+                        err = handler->binary(handler->arg, client->fd, &req);
+                } else {
+                        char *nl = memchr(client->buf, '\n', client->len);
+
+                        if (!nl) {
+                                /* A line that doesn't fit is nothing we'd
+                                 * understand anyway. */
+                                if (client->len == sizeof(client->buf)) {
+                                        drop_client(client);
+                                }
+                                return;
+                        }
+
+                        *nl = '\0';
+                        used = nl - client->buf + 1;
+                        err = handler->text(handler->arg, client->fd, client->buf);
+                }
+
+                if (err) {
+                        drop_client(client);
+                        return;
+                }
+
+                client->len -= used;
+                memmove(client->buf, client->buf + used, client->len);
+        }
+}
+
+/* Replies are small, and a client that can't take one straight away gets
+ * dropped rather than holding up the event loop. */
+int control_send(int fd, const void *buf, size_t len)
+{
+        return send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/* For replies bigger than the socket buffer takes in one go, like a scrape.
+ * Unlike control_send, this waits for it to drain, but only for so long: a
+ * client that stops reading still can't hold up the event loop for more
+ * than a second. */
+int control_send_all(int fd, const void *buf, size_t len)
+{
+        struct timeval timeout = { .tv_sec = 1 };
+        const char *data = buf;
+
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+                return -1;
+        }
+
+        while (len) {
+                ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+
+                if (n <= 0) {
+                        return -1;
+                }
+
+                data += n;
+                len -= n;
+        }
+
+        return 0;
+}
+
+void close_control(struct control *control)
+{
+        if (control->fd < 0) {
+                return;
+        }
+
+        for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+                if (control->clients[i].fd >= 0) {
+                        drop_client(&control->clients[i]);
+                }
+        }
+
+        close(control->fd);
+        control->fd = -1;
+
+        if (control->path) {
+                unlink(control->path);
+        }
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+#include <stddef.h>
+
+/* Binary protocol for the --control socket. Both ends are on the same
+ * machine, so everything is in host byte order, addresses included. A
+ * binary request starts with a zero byte, which no text command does, so
+ * the two can be mixed on one connection. Every request gets a
+ * struct control_reply, followed by count records for the request's op. */
+
+enum control_op {
+        /* Heaviest SYN senders of the current time period, as
+         * struct control_top records. */
+        CONTROL_TOP = 1,
+        /* One struct control_host record for addr. */
+        CONTROL_QUERY,
+        /* Block or unblock addr/prefixlen. Unblocking clears every reason,
+         * not just ours; a detector that still sees the host over its
+         * threshold will block it again. */
+        CONTROL_BLOCK,
+        CONTROL_UNBLOCK,
+        /* Read or change a threshold. value is the old one either way. */
+        CONTROL_GET,
+        CONTROL_SET,
+};
+
+/* The thresholds that can be changed at runtime, named after their options. */
+enum control_param {
+        CONTROL_NUM_PACKETS,
+        CONTROL_NUM_HOSTS,
+        CONTROL_PORT_SOURCES,
+        CONTROL_PREFIX_PACKETS,
+        CONTROL_UDP_PACKETS,
+        CONTROL_ICMP_PACKETS,
+        CONTROL_CLOSED_WEIGHT,
+        CONTROL_PARAM_MAX,
+};
+
+struct control_request {
+        unsigned char zero;
+        unsigned char op;
+        unsigned char prefixlen;
+        unsigned char param;
+        unsigned int addr;
+        long long value;
+};
+
+struct control_reply {
+        /* Zero, or a negative errno. */
+        int status;
+        unsigned int count;
+        long long value;
+};
+
+struct control_top {
+        unsigned int host;
+        unsigned int syns;
+        unsigned int error;
+};
+
+struct control_host {
+        unsigned int host;
+        /* Distinct ports and destinations in the current time period. */
+        unsigned int ports;
+        unsigned int dests;
+        /* enum block_reason bits, or zero if the host isn't blocked. */
+        unsigned int reasons;
+        /* What the estimator compares against -n. */
+        double rate;
+};
+
+/* The server side, in control.c, which also takes --metrics-port scrapes.
+ * There are never more than a couple of operators, so a small fixed table
+ * of clients will do. */
+#define MAX_CONTROL_CLIENTS 8
+
+struct control_client {
+        int fd;
+        size_t len;
+        char buf[256];
+};
+
+/* What to do with a complete request. Both return nonzero to have the
+ * client dropped, usually because it couldn't take the reply. */
+struct control_handler {
+        int (*binary)(void *arg, int fd, const struct control_request *req);
+        int (*text)(void *arg, int fd, char *line);
+        void *arg;
+};
+
+struct control {
+        int fd;
+        int epollfd;
+        const char *path;
+        struct control_handler handler;
+        struct control_client clients[MAX_CONTROL_CLIENTS];
+};
+
+/* Both return -1 with errno set if they can't listen. */
+int open_control(struct control *control, const char *path, int epollfd, const struct control_handler *handler);
+int open_metrics(struct control *metrics, long port, int epollfd);
+void accept_control(struct control *control);
+struct control_client *find_client(struct control *control, int fd);
+int read_client(struct control_client *client);
+void drop_client(struct control_client *client);
+void serve_control(struct control *control, struct control_client *client);
+int control_send(int fd, const void *buf, size_t len);
+int control_send_all(int fd, const void *buf, size_t len);
+void close_control(struct control *control);
+
+#endif /* __CONTROL_H */
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#include <string.h>
+
+#include "hist.h"
+
+/* Values below HIST_SUB_BUCKETS get a bucket each. Above that, the top set
+ * bit picks the power of two and the next HIST_SUB_BITS bits the bucket
+ * within it. */
+static unsigned int hist_index(unsigned long long value)
+{
+        unsigned int shift;
+
+        if (value < HIST_SUB_BUCKETS) {
+                return value;
+        }
+
+        shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+        if (shift + 1 >= HIST_MAGNITUDES) {
+                return HIST_BUCKETS - 1;
+        }
+
+        return (shift + 1) * HIST_SUB_BUCKETS + (value >> shift) - HIST_SUB_BUCKETS;
+}
+
+/* Largest value that lands in bucket idx. */
+static unsigned long long hist_upper(unsigned int idx)
+{
+        unsigned int magnitude = idx / HIST_SUB_BUCKETS;
+        unsigned long long sub = idx % HIST_SUB_BUCKETS;
+
+        if (!magnitude) {
+                return sub;
+        }
+
+        return ((HIST_SUB_BUCKETS + sub + 1) << (magnitude - 1)) - 1;
+}
+
+void hist_clear(struct hist *h)
+{
+        memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct hist *h, unsigned long long value)
+{
+        h->counts[hist_index(value)]++;
+        h->total++;
+        h->sum += value;
+
+        if (value > h->max) {
+                h->max = value;
+        }
+}
+
+/* Smallest value that at least a fraction q of the recorded values are no
+ * bigger than, rounded up to the end of its bucket. The top bucket is
+ * open-ended, so it says max instead. */
+unsigned long long hist_quantile(const struct hist *h, double q)
+{
+        unsigned long long rank = q * h->total;
+        unsigned long long seen = 0;
+
+        if (!h->total) {
+                return 0;
+        }
+
+        if (rank >= h->total) {
+                rank = h->total - 1;
+        }
+
+        for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+                seen += h->counts[i];
+                if (seen > rank) {
+                        unsigned long long upper = hist_upper(i);
+
+                        return upper < h->max && i < HIST_BUCKETS - 1 ? upper : h->max;
+                }
+        }
+
+        return h->max;
+}
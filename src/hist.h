@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __HIST_H
+#define __HIST_H
+
+/* Log-linear latency histogram, in the style of HdrHistogram. Every power of
+ * two is split into HIST_SUB_BUCKETS equal buckets, so any value is known to
+ * within 1/HIST_SUB_BUCKETS of itself, whether it's 50ns or 5s, in a fixed
+ * 2.5KiB. 2^40ns is about 18 minutes; anything longer goes in the top
+ * bucket. */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAGNITUDES 40
+#define HIST_BUCKETS (HIST_MAGNITUDES * HIST_SUB_BUCKETS)
+
+struct hist {
+        unsigned long long counts[HIST_BUCKETS];
+        unsigned long long total;
+        unsigned long long sum;
+        unsigned long long max;
+};
+
+void hist_clear(struct hist *h);
+void hist_record(struct hist *h, unsigned long long value);
+unsigned long long hist_quantile(const struct hist *h, double q);
+
+#endif /* __HIST_H */
@@ -0,0 +1,230 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sketch.h"
+
+/* Multiply-shift hashing. Each row gets its own odd multiplier, so a pair of
+ * keys that collide in one row almost never collide in the others. */
+static inline unsigned int sketch_index(const struct sketch *s, int row, unsigned int key)
+{
+        return (key * s->seeds[row]) >> (32 - SKETCH_WIDTH_BITS);
+}
+
+void sketch_init(struct sketch *s, unsigned int seed)
+{
+        /* Seed the rows from the caller so that a remote host can't pick
+         * addresses that are known to collide with a victim's. xorshift
+         * gets stuck at zero, so nudge it off. */
+        if (!seed) {
+                seed = 1;
+        }
+
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+                /* xorshift32, so we don't disturb anyone else's random(). */
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                s->seeds[row] = seed | 1;
+        }
+
+        sketch_clear(s);
+}
+
+void sketch_clear(struct sketch *s)
+{
+        memset(s->counts, 0, sizeof(s->counts));
+        s->total = 0;
+}
+
+/* Count one occurrence of key and return the new estimate. This uses
+ * conservative update: only the counters that are currently at the minimum
+ * are incremented, which keeps the overestimate much lower than a plain
+ * count-min sketch at the same size. */
+unsigned int sketch_add(struct sketch *s, unsigned int key)
+{
+        unsigned int idx[SKETCH_DEPTH];
+        unsigned int min = ~0U;
+
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+                idx[row] = sketch_index(s, row, key);
+                if (s->counts[row][idx[row]] < min) {
+                        min = s->counts[row][idx[row]];
+                }
+        }
+
+        /* Saturate rather than wrap. */
+        if (min == ~0U) {
+                return min;
+        }
+
+        min++;
+
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+                if (s->counts[row][idx[row]] < min) {
+                        s->total += min - s->counts[row][idx[row]];
+                        s->counts[row][idx[row]] = min;
+                }
+        }
+
+        return min;
+}
+
+unsigned int sketch_estimate(const struct sketch *s, unsigned int key)
+{
+        unsigned int min = ~0U;
+
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+                unsigned int count = s->counts[row][sketch_index(s, row, key)];
+                if (count < min) {
+                        min = count;
+                }
+        }
+
+        return min;
+}
+
+/* About what a key nobody has added would be estimated at anyway. With
+ * conservative update the counters fill up evenly, so that's the average
+ * counter, rounded up, plus one for the unlucky keys whose counters are all
+ * a little fuller than the rest. */
+unsigned int sketch_floor(const struct sketch *s)
+{
+        const unsigned long long counters = SKETCH_DEPTH * SKETCH_WIDTH;
+        unsigned long long level;
+
+        if (!s->total) {
+                return 0;
+        }
+
+        level = (s->total + counters - 1) / counters + 1;
+
+        return level < ~0U ? level : ~0U;
+}
+
+void topk_clear(struct topk *t)
+{
+        t->size = 0;
+}
+
+/* Space-Saving: if the key is already tracked, bump it. Otherwise take a
+ * free slot, or evict the smallest counter and inherit its count as the
+ * error bound. Any key whose true count exceeds N / TOPK_SIZE is guaranteed
+ * to be in the table. */
+void topk_add(struct topk *t, unsigned int key)
+{
+        struct topk_entry *min = NULL;
+
+        for (unsigned int i = 0; i < t->size; i++) {
+                struct topk_entry *entry = &t->entries[i];
+
+                if (entry->key == key) {
+                        entry->count++;
+                        return;
+                }
+
+                if (!min || entry->count < min->count) {
+                        min = entry;
+                }
+        }
+
+        if (t->size < TOPK_SIZE) {
+                min = &t->entries[t->size++];
+                min->count = 0;
+        }
+
+        min->key = key;
+        min->error = min->count;
+        min->count++;
+}
+
+static int topk_compare(const void *a, const void *b)
+{
+        const struct topk_entry *x = a;
+        const struct topk_entry *y = b;
+
+        if (x->count > y->count) {
+                return -1;
+        } else if (x->count == y->count) {
+                return 0;
+        } else {
+                return 1;
+        }
+}
+
+/* Copy the tracked entries into out (which must hold TOPK_SIZE entries),
+ * largest first, and return how many there are. */
+unsigned int topk_sorted(const struct topk *t, struct topk_entry *out)
+{
+        memcpy(out, t->entries, t->size * sizeof(*out));
+        qsort(out, t->size, sizeof(*out), topk_compare);
+
+        return t->size;
+}
+
+void hll_clear(struct hll *h)
+{
+        memset(h->registers, 0, sizeof(h->registers));
+}
+
+/* murmur3's finalizer. HyperLogLog needs every bit of the hash to look
+ * random, which addresses from one subnet certainly don't. */
+static inline unsigned int hll_hash(unsigned int key)
+{
+        key ^= key >> 16;
+        key *= 0x85ebca6b;
+        key ^= key >> 13;
+        key *= 0xc2b2ae35;
+        key ^= key >> 16;
+
+        return key;
+}
+
+void hll_add(struct hll *h, unsigned int key)
+{
+        unsigned int hash = hll_hash(key);
+        unsigned int idx = hash >> (32 - HLL_BITS);
+
+        /* Position of the first set bit in the remaining bits. The guard bit
+         * caps the rank when they're all zero. */
+        unsigned char rank = __builtin_clz((hash << HLL_BITS) | (1U << (HLL_BITS - 1))) + 1;
+
+        if (rank > h->registers[idx]) {
+                h->registers[idx] = rank;
+        }
+}
+
+double hll_estimate(const struct hll *h)
+{
+        const double m = HLL_REGISTERS;
+        double sum = 0;
+        int zeros = 0;
+
+        for (int i = 0; i < HLL_REGISTERS; i++) {
+                sum += 1.0 / (1ULL << h->registers[i]);
+                if (!h->registers[i]) {
+                        zeros++;
+                }
+        }
+
+        /* 0.709 is the bias correction constant for 64 registers. */
+        double estimate = 0.709 * m * m / sum;
+
+        /* Small range correction: fall back to linear counting. */
+        if (estimate <= 2.5 * m && zeros) {
+                estimate = m * log(m / zeros);
+        }
+
+        return estimate;
+}
+
+/* Fold other into h, which then counts the union of both. */
+void hll_merge(struct hll *h, const struct hll *other)
+{
+        for (int i = 0; i < HLL_REGISTERS; i++) {
+                if (other->registers[i] > h->registers[i]) {
+                        h->registers[i] = other->registers[i];
+                }
+        }
+}
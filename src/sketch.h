@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __SKETCH_H
+#define __SKETCH_H
+
+/* Count-min sketch dimensions. The width must be a power of two so a row
+ * index is just the top bits of a multiplicative hash. 4 x 4096 counters is
+ * 64KiB, and with conservative update the overestimate stays well under one
+ * SYN per host for the few thousand hosts we expect in a time period. Past
+ * that, every counter fills up with other hosts' SYNs; sketch_floor says by
+ * about how much. */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH_BITS 12
+#define SKETCH_WIDTH (1 << SKETCH_WIDTH_BITS)
+
+/* Number of heavy hitters tracked by the Space-Saving summary. */
+#define TOPK_SIZE 32
+
+/* HyperLogLog registers for distinct counting. 64 registers is 64 bytes and
+ * a standard error of about 13%, which is plenty to tell a handful of
+ * clients from a botnet. */
+#define HLL_BITS 6
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+/* Fixed-size approximate counter. Memory use does not depend on the number
+ * of distinct keys, which is what we want when every SYN in a spoofed flood
+ * comes from a different source. */
+struct sketch {
+        unsigned int seeds[SKETCH_DEPTH];
+        unsigned int counts[SKETCH_DEPTH][SKETCH_WIDTH];
+        /* All the counters added up, for sketch_floor(). */
+        unsigned long long total;
+};
+
+/* A single Space-Saving counter. count overestimates the true count by at
+ * most error. */
+struct topk_entry {
+        unsigned int key;
+        unsigned int count;
+        unsigned int error;
+};
+
+struct topk {
+        unsigned int size;
+        struct topk_entry entries[TOPK_SIZE];
+};
+
+/* Approximate count of distinct keys. */
+struct hll {
+        unsigned char registers[HLL_REGISTERS];
+};
+
+void sketch_init(struct sketch *s, unsigned int seed);
+void sketch_clear(struct sketch *s);
+unsigned int sketch_add(struct sketch *s, unsigned int key);
+unsigned int sketch_estimate(const struct sketch *s, unsigned int key);
+unsigned int sketch_floor(const struct sketch *s);
+
+void topk_clear(struct topk *t);
+void topk_add(struct topk *t, unsigned int key);
+unsigned int topk_sorted(const struct topk *t, struct topk_entry *out);
+
+void hll_clear(struct hll *h);
+void hll_add(struct hll *h, unsigned int key);
+double hll_estimate(const struct hll *h);
+void hll_merge(struct hll *h, const struct hll *other);
+
+#endif /* __SKETCH_H */
@@ -4,71 +4,736 @@
 #include <bpf/bpf_endian.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
+#include <xdp/xdp_helpers.h>
 #include "xdpfilter.h"
 
 struct trace_event_raw_bpf_trace_printk___x {};
 
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
-/* IP blacklist. IPs are in host byte order. */
+/* Headers can't be further in than this: two VLAN tags, and IP options. */
+#define MAX_L3_OFFSET (sizeof(struct ethhdr) + 2 * sizeof(struct vlan_hdr))
+#define MAX_L4_OFFSET (MAX_L3_OFFSET + 60)
+
+/* More things vmlinux.h doesn't carry. */
+#define ETH_ALEN 6
+#define IP_DF 0x4000
+#define BPF_F_CURRENT_NETNS (-1L)
+#define ICMP_ECHO 8
+#define BPF_MAP_TYPE_BLOOM_FILTER 30
+#define TC_ACT_OK 0
+#define TC_ACT_SHOT 2
+
+/* How much of a packet tc_ingress needs in the linear part of the skb: every
+ * header we might look at, up to the TCP flags. */
+#define TC_PULL_LEN (MAX_L4_OFFSET + sizeof(struct tcphdr))
+
+/* The raw syncookie helpers (Linux 6.0) are newer than our helper
+ * definitions. Only xdp_syncookie calls them, and userspace doesn't load it
+ * on kernels that don't have them. */
+static __s64 (*tcp_raw_gen_syncookie_ipv4)(struct iphdr *iph, struct tcphdr *th, __u32 th_len) = (void *) 204;
+static long (*tcp_raw_check_syncookie_ipv4)(struct iphdr *iph, struct tcphdr *th) = (void *) 206;
+
+/* Our SYN-ACKs carry an MSS option and nothing else. */
+#define SYNACK_TCP_LEN (sizeof(struct tcphdr) + 4)
+#define SYNACK_LEN (sizeof(struct ethhdr) + sizeof(struct iphdr) + SYNACK_TCP_LEN)
+
+/* Trusted sources and prefixes. Traffic from them is never counted or
+ * blocked. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, 16384);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct prefix_key);
+	__type(value, u8);
+} allowlist SEC(".maps");
+
+/* Static threat feed. IPs are in host byte order. The Bloom filter says
+ * "maybe" for everything in threatlist and "no" for almost everything else,
+ * so clean traffic never touches the (potentially huge) hash. Userspace sizes
+ * both from the feed before loading. On kernels without Bloom filters, it
+ * becomes an empty queue, since the type has to be one the verifier knows,
+ * and settings.threat_queue says to skip it. */
+struct {
+	__uint(type, BPF_MAP_TYPE_BLOOM_FILTER);
+	__uint(max_entries, 1);
+	__uint(map_extra, 3);
+	__type(value, u32);
+} threat_bloom SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, u32);
+	__type(value, u8);
+} threatlist SEC(".maps");
+
+/* Prefixes from the static blocklist. Userspace sizes it to the file, like
+ * threatlist; addresses are in network byte order, as in every LPM trie. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, 1);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct prefix_key);
+	__type(value, u8);
+} threat_prefixes SEC(".maps");
+
+/* IP blacklist. IPs are in host byte order. Values are enum block_reason
+ * bits, which only matter to userspace. */
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__uint(max_entries, 8192);
 	__type(key, u32);
-	__type(value, bool);
+	__type(value, u8);
 } blacklist SEC(".maps");
 
+/* Our own hosts, caught scanning outward. tc_egress drops their SYNs, so
+ * they can't open new connections, but existing ones carry on. */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1024);
+	__type(key, u32);
+	__type(value, u8);
+} egress_blacklist SEC(".maps");
+
+/* Prefix blacklist, for sources that are only bad in aggregate. Values are
+ * enum prefix_reason. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, 8192);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct prefix_key);
+	__type(value, u8);
+} prefix_blacklist SEC(".maps");
+
+/* Runtime settings. */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct settings);
+} settings SEC(".maps");
+
+/* Per-source and per-prefix SYN rates, overriding the default in config.
+ * IPs in host_rates are in host byte order. */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 8192);
+	__type(key, u32);
+	__type(value, struct rate_limit);
+} host_rates SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, 8192);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct prefix_key);
+	__type(value, struct rate_limit);
+} prefix_rates SEC(".maps");
+
+/* GCRA state: the theoretical arrival time of each source's next SYN. One
+ * timestamp per source is all GCRA needs, and LRU eviction only ever forgets
+ * sources that have been quiet the longest, which are the ones that would be
+ * allowed through anyway. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 65536);
+	__type(key, u32);
+	__type(value, u64);
+} gcra SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, STAT_MAX);
+	__type(key, u32);
+	__type(value, u64);
+} stats SEC(".maps");
+
+/* Which ports we care about. See struct port_policy. */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, PORT_POLICY_ENTRIES);
+	__type(key, u32);
+	__type(value, struct port_policy);
+} port_policy SEC(".maps");
+
+/* enum flag_pattern for each TCP flags byte. */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 256);
+	__type(key, u32);
+	__type(value, u8);
+} flag_policy SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, PATTERN_MAX);
+	__type(key, u32);
+	__type(value, u64);
+} flag_drops SEC(".maps");
+
+/* The parser stages, indexed by enum stage. Userspace fills this in after
+ * loading, and any stage can be swapped for another program at runtime. A
+ * tail call into an empty slot falls through, and we pass the packet; that's
+ * also how SYN cookie mode quietly does nothing on kernels without the
+ * syncookie helpers. */
+struct {
+	__uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+	__uint(max_entries, STAGE_MAX);
+	__type(key, u32);
+	__type(value, u32);
+} stages SEC(".maps");
+
+/* What the stages so far found out about the packet. A tail call never
+ * leaves the CPU, so a per-CPU slot is all the hand-over needs. */
+struct parse_state {
+        /* Offsets of the IP and transport headers. */
+        u32 l3;
+        u32 l4;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct parse_state);
+} parse_state SEC(".maps");
+
 struct {
 	__uint(type, BPF_MAP_TYPE_RINGBUF);
 	__uint(max_entries, 256 * 1024);
 } ringbuf SEC(".maps");
 
-SEC("xdp_syn")
-int xdp_prog_simple(struct xdp_md *ctx)
+static __always_inline void count_stat(u32 stat)
 {
-        void *data;
-        void *data_end;
-        struct ethhdr *ethh;
-        u64 offset;
-        u16 eth_type;
+        u64 *count = bpf_map_lookup_elem(&stats, &stat);
+
+        if (count) {
+                *count += 1;
+        }
+}
+
+static __always_inline struct settings *get_settings(void)
+{
+        u32 zero = 0;
+
+        return bpf_map_lookup_elem(&settings, &zero);
+}
+
+/* Generic cell rate algorithm: allow a SYN from host unless it arrives more
+ * than burst nanoseconds ahead of its theoretical arrival time. saddr is the
+ * same address in network byte order, for the prefix lookup. */
+static __always_inline bool gcra_allow(u32 host, u32 saddr)
+{
+        struct rate_limit *limit;
+        struct settings *conf;
+        u64 now, tat, *last;
+
+        limit = bpf_map_lookup_elem(&host_rates, &host);
+        if (!limit) {
+                struct prefix_key pkey = {
+                        .prefixlen = 32,
+                        .addr = saddr,
+                };
+
+                limit = bpf_map_lookup_elem(&prefix_rates, &pkey);
+        }
+
+        if (!limit) {
+                conf = get_settings();
+                if (!conf) {
+                        return true;
+                }
+
+                limit = &conf->syn_rate;
+        }
+
+        if (!limit->interval) {
+                return true;
+        }
+
+        now = bpf_ktime_get_ns();
+        tat = now;
+
+        last = bpf_map_lookup_elem(&gcra, &host);
+        if (last && *last > now) {
+                tat = *last;
+        }
+
+        if (tat - now > limit->burst) {
+                count_stat(STAT_RATE_LIMITED);
+                return false;
+        }
+
+        tat += limit->interval;
+
+        /* Racing CPUs can each let one SYN through for the same slot, which
+         * is fine for a rate limiter. */
+        if (last) {
+                *last = tat;
+        } else {
+                bpf_map_update_elem(&gcra, &host, &tat, BPF_ANY);
+        }
+
+        return true;
+}
+
+/* Event flags for a SYN to port (in host byte order), or -1 if it isn't
+ * worth an event at all. */
+static __always_inline int port_flags(struct settings *conf, u16 port)
+{
+        u32 key = port / 32;
+        u32 bit = 1U << (port % 32);
+        struct port_policy *policy = bpf_map_lookup_elem(&port_policy, &key);
+
+        if (!policy) {
+                return 0;
+        }
+
+        if (policy->closed & bit) {
+                return EVENT_CLOSED;
+        }
+
+        if (conf && conf->port_filter && !(policy->protect & bit)) {
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Reserve an event for this packet. The caller fills in anything else and
+ * submits it. A full ring means userspace isn't keeping up, so count it. */
+static __always_inline struct event *new_event(struct iphdr *iph, u16 port, u8 proto)
+{
+        struct event *e = bpf_ringbuf_reserve(&ringbuf, sizeof(*e), 0);
+
+        if (!e) {
+                count_stat(STAT_EVENTS_LOST);
+                return NULL;
+        }
+
+        e->host = bpf_ntohl(iph->saddr);
+        e->dest = bpf_ntohl(iph->daddr);
+        e->port = port;
+        e->flags = 0;
+        e->proto = proto;
+        e->ts = bpf_ktime_get_ns();
+
+        return e;
+}
+
+/* Stage bodies return an XDP action, or next_stage() of the stage that
+ * should look at the packet next. */
+static __always_inline int next_stage(u32 stage)
+{
+        return -1 - (int)stage;
+}
+
+static __always_inline struct parse_state *get_state(void)
+{
+        u32 zero = 0;
+
+        return bpf_map_lookup_elem(&parse_state, &zero);
+}
+
+/* The headers an earlier stage found, bounds checked again for the
+ * verifier's benefit. */
+static __always_inline struct iphdr *state_iph(struct parse_state *state, void *data, void *data_end)
+{
+        u32 off = state->l3;
         struct iphdr *iph;
-        enum xdp_action action;
-        u8 iphdr_len;
-        struct tcphdr *tcph;
-        struct event *e;        
+
+        if (off > MAX_L3_OFFSET) {
+                return NULL;
+        }
+
+        iph = data + off;
+        if ((void *)(iph + 1) > data_end) {
+                return NULL;
+        }
+
+        return iph;
+}
+
+static __always_inline void *state_l4(struct parse_state *state, void *data, void *data_end, u32 size)
+{
+        u32 off = state->l4;
+
+        if (off > MAX_L4_OFFSET || data + off + size > data_end) {
+                return NULL;
+        }
+
+        return data + off;
+}
+
+/* UDP and ICMP echo requests only need counting, and only if someone asked
+ * for flood detection. A single packet is never a reason to drop. */
+static __always_inline void report_flood(struct iphdr *iph, u16 port)
+{
+        struct event *e = new_event(iph, port, iph->protocol);
+
+        if (e) {
+                bpf_ringbuf_submit(e, 0);
+        }
+}
+
+static __always_inline int udp_stage(void *ctx, struct parse_state *state, void *data, void *data_end)
+{
+        struct settings *conf = get_settings();
+        struct iphdr *iph = state_iph(state, data, data_end);
+        struct udphdr *udph = state_l4(state, data, data_end, sizeof(*udph));
+
+        if (!iph || !udph) {
+                return XDP_DROP;
+        }
+
+        if (conf && conf->udp_floods) {
+                report_flood(iph, bpf_ntohs(udph->dest));
+        }
+
+        return XDP_PASS;
+}
+
+static __always_inline int icmp_stage(void *ctx, struct parse_state *state, void *data, void *data_end)
+{
+        struct settings *conf = get_settings();
+        struct iphdr *iph = state_iph(state, data, data_end);
+        struct icmphdr *icmph = state_l4(state, data, data_end, sizeof(*icmph));
+
+        if (!iph || !icmph) {
+                return XDP_DROP;
+        }
+
+        if (conf && conf->icmp_floods && icmph->type == ICMP_ECHO) {
+                report_flood(iph, 0);
+        }
+
+        return XDP_PASS;
+}
+
+static __always_inline u16 csum_fold(u64 csum)
+{
+        csum = (csum & 0xffff) + (csum >> 16);
+        csum = (csum & 0xffff) + (csum >> 16);
+        csum = (csum & 0xffff) + (csum >> 16);
+
+        return ~csum;
+}
+
+/* State of the socket this segment belongs to, or -1 if there isn't one.
+ * A listener counts, so check for TCP_LISTEN. */
+static __always_inline int tcp_socket_state(void *ctx, struct iphdr *iph, struct tcphdr *tcph)
+{
+        struct bpf_sock_tuple tuple = {};
+        struct bpf_sock *sk;
+        int state;
+
+        tuple.ipv4.saddr = iph->saddr;
+        tuple.ipv4.daddr = iph->daddr;
+        tuple.ipv4.sport = tcph->source;
+        tuple.ipv4.dport = tcph->dest;
+
+        sk = bpf_skc_lookup_tcp(ctx, &tuple, sizeof(tuple.ipv4), BPF_F_CURRENT_NETNS, 0);
+        if (!sk) {
+                return -1;
+        }
+
+        state = sk->state;
+        bpf_sk_release(sk);
+
+        return state;
+}
+
+/* Turn the SYN at the start of the packet into our SYN-ACK, with the cookie
+ * as its sequence number, and send it back out. */
+static __always_inline int syncookie_syn(struct xdp_md *ctx, struct iphdr *iph, struct tcphdr *tcph, u32 tcp_len)
+{
+        void *data = (void *)(long)ctx->data;
+        void *data_end = (void *)(long)ctx->data_end;
+        struct ethhdr *ethh = data;
+        u8 header[60] = {};
+        u32 copied = 0;
+        u8 src[ETH_ALEN], dst[ETH_ALEN];
+        u32 saddr, daddr, seq, cookie;
+        u16 sport, dport, mss;
+        s64 value;
+
+        /* Nobody listening: let the kernel send its RST, rather than making
+         * every closed port look open to a scanner. */
+        if (tcp_socket_state(ctx, iph, tcph) != TCP_LISTEN) {
+                return XDP_PASS;
+        }
+
+        /* The helper wants the whole TCP header, options included, for the
+         * MSS. The verifier can't follow a variable length into the packet,
+         * so copy it to the stack first. A header cut short by the end of
+         * the packet is no SYN we want to answer. */
+        #pragma unroll
+        for (int i = 0; i < sizeof(header); i++) {
+                u8 *byte = (u8 *)tcph + i;
+
+                if (i >= tcp_len || (void *)(byte + 1) > data_end) {
+                        break;
+                }
+
+                header[i] = *byte;
+                copied++;
+        }
+
+        if (copied != tcp_len) {
+                return XDP_DROP;
+        }
+
+        value = tcp_raw_gen_syncookie_ipv4(iph, (struct tcphdr *)header, tcp_len);
+        if (value < 0) {
+                return XDP_DROP;
+        }
+
+        cookie = value;
+        mss = value >> 32;
+
+        /* Everything we need from the SYN, before resizing the packet
+         * invalidates our pointers. */
+        __builtin_memcpy(src, ethh->h_source, ETH_ALEN);
+        __builtin_memcpy(dst, ethh->h_dest, ETH_ALEN);
+        saddr = iph->saddr;
+        daddr = iph->daddr;
+        sport = tcph->source;
+        dport = tcph->dest;
+        seq = tcph->seq;
+
+        if (bpf_xdp_adjust_tail(ctx, (int)SYNACK_LEN - (int)(data_end - data))) {
+                return XDP_DROP;
+        }
 
         data = (void *)(long)ctx->data;
         data_end = (void *)(long)ctx->data_end;
 
+        if (data + SYNACK_LEN > data_end) {
+                return XDP_DROP;
+        }
+
         ethh = data;
+        iph = (void *)(ethh + 1);
+        tcph = (void *)(iph + 1);
 
-        offset = sizeof(*ethh);
+        __builtin_memcpy(ethh->h_source, dst, ETH_ALEN);
+        __builtin_memcpy(ethh->h_dest, src, ETH_ALEN);
 
-        /* Spooky packet. Drop. */
-        if (data + offset > data_end) {
+        iph->version = 4;
+        iph->ihl = sizeof(*iph) / 4;
+        iph->tos = 0;
+        iph->tot_len = bpf_htons(sizeof(*iph) + SYNACK_TCP_LEN);
+        iph->id = 0;
+        iph->frag_off = bpf_htons(IP_DF);
+        iph->ttl = 64;
+        iph->protocol = IPPROTO_TCP;
+        iph->check = 0;
+        iph->saddr = daddr;
+        iph->daddr = saddr;
+        iph->check = csum_fold((u32)bpf_csum_diff(NULL, 0, (__be32 *)iph, sizeof(*iph), 0));
+
+        __builtin_memset(tcph, 0, SYNACK_TCP_LEN);
+        tcph->source = dport;
+        tcph->dest = sport;
+        tcph->seq = bpf_htonl(cookie);
+        tcph->ack_seq = bpf_htonl(bpf_ntohl(seq) + 1);
+        tcph->doff = SYNACK_TCP_LEN / 4;
+        tcph->syn = 1;
+        tcph->ack = 1;
+        tcph->window = bpf_htons(65535);
+
+        u8 *opt = (u8 *)(tcph + 1);
+        opt[0] = 2;     /* TCPOPT_MSS */
+        opt[1] = 4;
+        *(u16 *)(opt + 2) = bpf_htons(mss);
+
+        /* The pseudo-header sums the same either way round, so the
+         * addresses and the rest can go in as they are. */
+        u64 csum = (u32)bpf_csum_diff(NULL, 0, (__be32 *)tcph, SYNACK_TCP_LEN, 0);
+        csum += saddr;
+        csum += daddr;
+        csum += bpf_htons(IPPROTO_TCP);
+        csum += bpf_htons(SYNACK_TCP_LEN);
+        tcph->check = csum_fold(csum);
+
+        count_stat(STAT_SYNCOOKIE_SENT);
+
+        return XDP_TX;
+}
+
+/* An ACK during SYN cookie mode. Anything belonging to a connection the
+ * kernel already knows about goes straight through; everything else has to
+ * carry a valid cookie. The kernel checks the cookie again and makes the
+ * socket, but only if net.ipv4.tcp_syncookies is 2: it never saw the SYN, so
+ * as far as it knows it hasn't sent any cookies. */
+static __always_inline int syncookie_ack(struct xdp_md *ctx, struct iphdr *iph, struct tcphdr *tcph)
+{
+        int state = tcp_socket_state(ctx, iph, tcph);
+
+        if (state >= 0 && state != TCP_LISTEN) {
+                return XDP_PASS;
+        }
+
+        if (tcp_raw_check_syncookie_ipv4(iph, tcph)) {
+                count_stat(STAT_SYNCOOKIE_INVALID);
                 return XDP_DROP;
         }
 
-        eth_type = ethh->h_proto;
+        count_stat(STAT_SYNCOOKIE_VALID);
 
-        /* Don't care about IPv6 for now. This would be exploitable. */
-        if (eth_type == bpf_ntohs(ETH_P_IPV6)) {
+        return XDP_PASS;
+}
+
+/* SYN cookie mode, for SYNs and ACKs the TCP stage has already let
+ * through. */
+static __always_inline int syncookie_stage(struct xdp_md *ctx, struct parse_state *state, void *data, void *data_end)
+{
+        struct iphdr *iph;
+        struct tcphdr *tcph;
+        u32 tcp_len;
+
+        /* Only untagged frames with plain 20 byte IP headers, so that the
+         * SYN-ACK can be written at fixed offsets. Nobody sends IP options
+         * on a SYN anyway. */
+        if (state->l3 != sizeof(struct ethhdr)) {
                 return XDP_PASS;
         }
 
-        /* For now (or longer), we ignore VLAN and VLAN-within-VLAN packets 
-         * (802.11q and 802.11ad, respectively). Were this more production-
-         * ready, we would need to adjust our IP packet offset accordingly. */
+        iph = data + sizeof(struct ethhdr);
+
+        if ((void *)(iph + 1) > data_end) {
+                return XDP_DROP;
+        }
 
-        /* Take apart the IP packet. */
-        iph = data + offset;
+        if (iph->ihl != 5 || iph->protocol != IPPROTO_TCP) {
+                return XDP_PASS;
+        }
+
+        tcph = (void *)(iph + 1);
+
+        if ((void *)(tcph + 1) > data_end) {
+                return XDP_DROP;
+        }
 
-        if (iph + 1 > data_end) {
+        tcp_len = tcph->doff * 4;
+        if (tcp_len < sizeof(*tcph)) {
                 return XDP_DROP;
         }
 
-        /* Check if this is a blocked host, but don't return yet because we
-         * still want to count connection attempts, even if they're blocked. */
+        if (tcph->syn && !tcph->ack) {
+                return syncookie_syn(ctx, iph, tcph, tcp_len);
+        }
+
+        if (tcph->ack && !tcph->syn && !tcph->rst) {
+                return syncookie_ack(ctx, iph, tcph);
+        }
+
+        return XDP_PASS;
+}
+
+static __always_inline int tcp_stage(void *ctx, struct parse_state *state, void *data, void *data_end)
+{
+        struct iphdr *iph = state_iph(state, data, data_end);
+        struct tcphdr *tcph = state_l4(state, data, data_end, sizeof(*tcph));
+        struct event *e;
+
+        /* Spooky packet. Drop. */
+        if (!iph || !tcph) {
+                return XDP_DROP;
+        }
+
+        /* Stealth scans, dropped on the spot by a single lookup on the
+         * flags byte, which follows the data offset. */
+        u32 tcp_flags = ((u8 *)tcph)[13];
+        u8 *pattern = bpf_map_lookup_elem(&flag_policy, &tcp_flags);
+
+        if (pattern && *pattern != PATTERN_OK) {
+                u32 key = *pattern;
+                u64 *drops = bpf_map_lookup_elem(&flag_drops, &key);
+
+                if (drops) {
+                        *drops += 1;
+                }
+
+                return XDP_DROP;
+        }
+
+        struct settings *conf = get_settings();
+        bool syncookies = conf && conf->syncookies;
+
+        /* Check for SYN requests, making sure to ignore SYN ACK. */
+        if (tcph->syn && !tcph->ack) {
+                count_stat(STAT_SYN);
+
+                /* SYNs over the source's rate are dropped one by one, without
+                 * bothering userspace. */
+                if (!gcra_allow(bpf_ntohl(iph->saddr), iph->saddr)) {
+                        return XDP_DROP;
+                }
+
+                /* SYNs to ports nobody asked us to watch are none of
+                 * userspace's business. */
+                int flags = port_flags(conf, bpf_ntohs(tcph->dest));
+
+                if (flags >= 0) {
+                        e = new_event(iph, bpf_ntohs(tcph->dest), IPPROTO_TCP);
+                        if (e) {
+                                /* Fill out the rest of the event struct and
+                                 * submit it to userspace. */
+                                e->flags = flags;
+
+                                if (conf && conf->listener_aware &&
+                                    tcp_socket_state(ctx, iph, tcph) == TCP_LISTEN) {
+                                        e->flags |= EVENT_LISTENER;
+                                }
+
+                                bpf_ringbuf_submit(e, 0);
+                        } else if (!syncookies) {
+                                /* Exploitable. If we pass whenever we can't
+                                 * reserve enough space for the ringbuffer, we
+                                 * fail open and malicious hosts could
+                                 * continue to send us packets. In SYN cookie
+                                 * mode that's fine, since the SYN never
+                                 * reaches the kernel. */
+                                return XDP_PASS;
+                        }
+                }
+
+                return syncookies ? next_stage(STAGE_SYNCOOKIE) : XDP_PASS;
+        }
+
+        if (syncookies && tcph->ack && !tcph->syn && !tcph->rst) {
+                return next_stage(STAGE_SYNCOOKIE);
+        }
+
+        return XDP_PASS;
+}
+
+/* Source checks, which apply to every IPv4 packet whatever it carries. */
+static __always_inline int ipv4_stage(void *ctx, struct parse_state *state, void *data, void *data_end)
+{
+        struct iphdr *iph = state_iph(state, data, data_end);
+        u32 iphdr_len;
+
+        /* Spooky packet. Drop. */
+        if (!iph) {
+                return XDP_DROP;
+        }
+
+        struct prefix_key pkey = {
+                .prefixlen = 32,
+                .addr = iph->saddr,
+        };
+
+        /* Trusted sources skip everything else. */
+        if (bpf_map_lookup_elem(&allowlist, &pkey)) {
+                return XDP_PASS;
+        }
+
+        /* Blocked hosts are dropped here, before anything is counted, so
+         * userspace only hears from them again once they're let go. */
         u32 host = bpf_ntohl(iph->saddr);
         
         bool found = bpf_map_lookup_elem(&blacklist, (void *)&host);
@@ -76,43 +741,234 @@ int xdp_prog_simple(struct xdp_md *ctx)
 		return XDP_DROP;
         }
 
+        /* Peeking a Bloom filter tests host and leaves it alone; peeking a
+         * queue would copy its head over host, so that never happens. */
+        struct settings *conf = get_settings();
+        bool maybe = conf && conf->threat_queue ? true : !bpf_map_peek_elem(&threat_bloom, &host);
+
+        if (maybe && bpf_map_lookup_elem(&threatlist, &host)) {
+                count_stat(STAT_THREAT);
+                return XDP_DROP;
+        }
+
+        if (bpf_map_lookup_elem(&threat_prefixes, &pkey)) {
+                count_stat(STAT_THREAT);
+                return XDP_DROP;
+        }
+
+        if (bpf_map_lookup_elem(&prefix_blacklist, &pkey)) {
+                return XDP_DROP;
+        }
+
         /* IP packets can have variable-length headers. */
         iphdr_len = iph->ihl * 4;
 
         /* Spooky packet. Drop. */
-        if (offset + iphdr_len > data_end) {
+        if (iphdr_len < sizeof(*iph) || (void *)iph + iphdr_len > data_end) {
 		return XDP_DROP;
         }
 
-        offset += iphdr_len;
+        state->l4 = state->l3 + iphdr_len;
 
-        /* Take apart the TCP packet. */
-        tcph = data + offset;
+        switch (iph->protocol) {
+        case IPPROTO_TCP:
+                return next_stage(STAGE_TCP);
+        case IPPROTO_UDP:
+                return next_stage(STAGE_UDP);
+        case IPPROTO_ICMP:
+                return next_stage(STAGE_ICMP);
+        default:
+                return XDP_PASS;
+        }
+}
+
+/* Find the network header, past up to two VLAN tags (802.1Q and 802.1ad),
+ * and pick the stage for it. */
+static __always_inline int eth_stage(void *ctx, struct parse_state *state, void *data, void *data_end)
+{
+        struct ethhdr *ethh = data;
+        u32 offset = sizeof(*ethh);
+        u16 eth_type;
 
         /* Spooky packet. Drop. */
-        if (tcph + 1 > data_end) {
+        if (data + offset > data_end) {
                 return XDP_DROP;
         }
 
-        /* Check for SYN requests, making sure to ignore SYN ACK. */
-        if (tcph->syn && !tcph->ack) {
-                e = bpf_ringbuf_reserve(&ringbuf, sizeof(*e), 0);
-                if (!e) {
-                        /* Exploitable. If we pass whenever we can't reserve
-                         * enough space for the ringbuffer, we fail open and
-                         * malicious hosts could continue to send us packets. */
-                        return XDP_PASS;
+        eth_type = ethh->h_proto;
+
+        #pragma unroll
+        for (int i = 0; i < 2; i++) {
+                struct vlan_hdr *vlanh = data + offset;
+
+                if (eth_type != bpf_htons(ETH_P_8021Q) && eth_type != bpf_htons(ETH_P_8021AD)) {
+                        break;
                 }
 
-                /* Fill out the event struct and submit it to userspace. */
-                e->host = bpf_ntohl(iph->saddr);
-                e->dest = bpf_ntohl(iph->daddr);
-                e->port = bpf_ntohs(tcph->dest);
+                if ((void *)(vlanh + 1) > data_end) {
+                        return XDP_DROP;
+                }
 
-                bpf_ringbuf_submit(e, 0);
+                eth_type = vlanh->h_vlan_encapsulated_proto;
+                offset += sizeof(*vlanh);
+        }
 
-                return XDP_PASS;
+        state->l3 = offset;
+
+        /* Don't care about IPv6 for now. This would be exploitable. */
+        if (eth_type == bpf_htons(ETH_P_IP)) {
+                return next_stage(STAGE_IPV4);
+        }
+
+        return XDP_PASS;
+}
+
+/* Tail call whatever stage ret asks for, if any. */
+static __always_inline int run_stage(struct xdp_md *ctx, int ret)
+{
+        if (ret >= 0) {
+                return ret;
         }
 
+        bpf_tail_call(ctx, &stages, -1 - ret);
+
+        /* Nothing in that slot. */
         return XDP_PASS;
 }
+
+/* Each stage is a program of its own, so a packet only ever runs the parsers
+ * it needs, and the verifier only ever sees one stage at a time. */
+#define XDP_STAGE(sec, name, body)                                              \
+SEC(sec)                                                                        \
+int name(struct xdp_md *ctx)                                                    \
+{                                                                               \
+        void *data = (void *)(long)ctx->data;                                   \
+        void *data_end = (void *)(long)ctx->data_end;                           \
+        struct parse_state *state = get_state();                                \
+                                                                                \
+        if (!state) {                                                           \
+                return XDP_PASS;                                                \
+        }                                                                       \
+                                                                                \
+        return run_stage(ctx, body(ctx, state, data, data_end));                \
+}
+
+/* The entry point, attached to the interface. */
+XDP_STAGE("xdp_syn", xdp_prog_simple, eth_stage)
+
+/* Defaults for the libxdp dispatcher, which userspace can override. We want
+ * to run before anything else on the interface (lower runs first), and let
+ * whatever comes next have the packets we pass. */
+struct {
+        __uint(priority, 10);
+        __uint(XDP_PASS, 1);
+} XDP_RUN_CONFIG(xdp_prog_simple);
+
+XDP_STAGE("xdp_ipv4", xdp_ipv4, ipv4_stage)
+XDP_STAGE("xdp_tcp", xdp_tcp, tcp_stage)
+XDP_STAGE("xdp_udp", xdp_udp, udp_stage)
+XDP_STAGE("xdp_icmp", xdp_icmp, icmp_stage)
+XDP_STAGE("xdp_syncookie", xdp_syncookie, syncookie_stage)
+
+/* The same pipeline as a TC classifier, for interfaces where XDP misbehaves
+ * or isn't available at all. Different program types can't tail call each
+ * other, so the stages run inline, and SYN cookies, which need XDP_TX, are
+ * left out. Every map is shared with the XDP programs. */
+SEC("tc")
+int tc_ingress(struct __sk_buff *skb)
+{
+        u32 len = skb->len < TC_PULL_LEN ? skb->len : TC_PULL_LEN;
+        struct parse_state *state = get_state();
+        void *data, *data_end;
+        int ret;
+
+        if (!state) {
+                return TC_ACT_OK;
+        }
+
+        data = (void *)(long)skb->data;
+        data_end = (void *)(long)skb->data_end;
+
+        /* Headers can be outside the linear part of an skb, unlike an XDP
+         * buffer. Pulling them in moves the data. */
+        if (data + len > data_end) {
+                bpf_skb_pull_data(skb, len);
+                data = (void *)(long)skb->data;
+                data_end = (void *)(long)skb->data_end;
+        }
+
+        ret = eth_stage(skb, state, data, data_end);
+
+        if (ret == next_stage(STAGE_IPV4)) {
+                ret = ipv4_stage(skb, state, data, data_end);
+        }
+
+        if (ret == next_stage(STAGE_TCP)) {
+                ret = tcp_stage(skb, state, data, data_end);
+        } else if (ret == next_stage(STAGE_UDP)) {
+                ret = udp_stage(skb, state, data, data_end);
+        } else if (ret == next_stage(STAGE_ICMP)) {
+                ret = icmp_stage(skb, state, data, data_end);
+        }
+
+        return ret == XDP_DROP ? TC_ACT_SHOT : TC_ACT_OK;
+}
+
+/* Outbound SYNs, for catching one of our own hosts scanning someone else.
+ * These go to userspace like any other SYN, with EVENT_EGRESS set, and that
+ * is all; nothing on the ingress side applies. */
+SEC("tc")
+int tc_egress(struct __sk_buff *skb)
+{
+        u32 len = skb->len < TC_PULL_LEN ? skb->len : TC_PULL_LEN;
+        struct parse_state *state = get_state();
+        void *data, *data_end;
+        struct iphdr *iph;
+        struct tcphdr *tcph;
+        struct event *e;
+
+        if (!state) {
+                return TC_ACT_OK;
+        }
+
+        data = (void *)(long)skb->data;
+        data_end = (void *)(long)skb->data_end;
+
+        if (data + len > data_end) {
+                bpf_skb_pull_data(skb, len);
+                data = (void *)(long)skb->data;
+                data_end = (void *)(long)skb->data_end;
+        }
+
+        /* Whatever we send that we can't make sense of is someone else's
+         * problem. */
+        if (eth_stage(skb, state, data, data_end) != next_stage(STAGE_IPV4)) {
+                return TC_ACT_OK;
+        }
+
+        iph = state_iph(state, data, data_end);
+        if (!iph || iph->protocol != IPPROTO_TCP || iph->ihl < 5) {
+                return TC_ACT_OK;
+        }
+
+        state->l4 = state->l3 + iph->ihl * 4;
+
+        tcph = state_l4(state, data, data_end, sizeof(*tcph));
+        if (!tcph || !tcph->syn || tcph->ack) {
+                return TC_ACT_OK;
+        }
+
+        u32 host = bpf_ntohl(iph->saddr);
+
+        if (bpf_map_lookup_elem(&egress_blacklist, &host)) {
+                return TC_ACT_SHOT;
+        }
+
+        e = new_event(iph, bpf_ntohs(tcph->dest), IPPROTO_TCP);
+        if (e) {
+                e->flags = EVENT_EGRESS;
+                bpf_ringbuf_submit(e, 0);
+        }
+
+        return TC_ACT_OK;
+}
@@ -3,65 +3,431 @@
 #include <apr_pools.h>
 #include <apr_skiplist.h>
 #include <argp.h>
+#include <math.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <net/if.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <bpf/libbpf.h>
 
+#include "control.h"
+#include "hist.h"
+#include "sketch.h"
 #include "xdpfilter.h"
 #include "xdpfilter.skel.h"
 #include "xdp/libxdp.h"
 
 #define MAX_EVENTS 10
 
-const bool blocked = true;
+/* Number of coarser windows that can run alongside -t. */
+#define MAX_WINDOWS 4
+
+/* Number of recent ports each decayed counter remembers, so that a client
+ * reconnecting to the same port doesn't look like a port scan. */
+#define DECAY_RECENT_PORTS 8
+
+/* Decayed counters below this are forgotten. */
+#define DECAY_EPSILON 0.05
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Number of interfaces -i can attach to at once. */
+#define MAX_INTERFACES 16
+
+/* Number of --rate overrides we accept on the command line. */
+#define MAX_RATES 64
+
+/* Measurement intervals the aggregate SYN rate has to stay under half of
+ * --syncookie-rate before SYN cookie mode is switched back off. */
+#define SYNCOOKIE_CALM 10
+
+/* BPF_FUNC_tcp_raw_gen_syncookie_ipv4 and BPF_MAP_TYPE_BLOOM_FILTER, which
+ * our UAPI headers predate. */
+#define HELPER_TCP_RAW_GEN_SYNCOOKIE_IPV4 204
+#define MAP_TYPE_BLOOM_FILTER 30
+
+/* Threat feed entries per batch update. */
+#define THREAT_BATCH 4096
+
+/* Number of runs of the XDP program per --bench measurement. */
+#define BENCH_REPEAT 1000000
+
+/* "xdpf", and the --snapshot format version. */
+#define SNAPSHOT_MAGIC 0x78647066
+#define SNAPSHOT_VERSION 1
 
 enum Level { DEBUG, INFO };
 
+/* How per-host rates are estimated. */
+enum Estimator { WINDOW, DECAY };
+
+/* Parts of the userspace loop that get timed, for --metrics-port. */
+enum timing {
+        TIME_HANDLE_EVENT,
+        TIME_MEASURE,
+        TIME_SWAP_HASH,
+        TIME_SNAPSHOT,
+        TIME_MAP_LOOKUP,
+        TIME_MAP_UPDATE,
+        TIME_MAX,
+};
+
+static const char *timing_names[TIME_MAX] = {
+        [TIME_HANDLE_EVENT] = "handle_event",
+        [TIME_MEASURE] = "measure",
+        [TIME_SWAP_HASH] = "swap_hash",
+        [TIME_SNAPSHOT] = "snapshot",
+        [TIME_MAP_LOOKUP] = "map_lookup",
+        [TIME_MAP_UPDATE] = "map_update",
+};
+
+/* Keys for options that only have a long form. */
+enum {
+        OPT_SKETCH_PROMOTE = 256,
+        OPT_PORT_SOURCES,
+        OPT_PREFIX_PACKETS,
+        OPT_PREFIX_LEN,
+        OPT_PER_DESTINATION,
+        OPT_ESTIMATOR,
+        OPT_REPLAY,
+        OPT_RECORD,
+        OPT_SYN_RATE,
+        OPT_SYN_BURST,
+        OPT_RATE,
+        OPT_SYNCOOKIE_RATE,
+        OPT_PROTECT_PORTS,
+        OPT_CLOSED_PORTS,
+        OPT_CLOSED_WEIGHT,
+        OPT_LISTENER_AWARE,
+        OPT_DROP_FLAGS,
+        OPT_UDP_PACKETS,
+        OPT_ICMP_PACKETS,
+        OPT_ALLOWLIST_FILE,
+        OPT_THREAT_FILE,
+        OPT_BLOCKLIST_FILE,
+        OPT_BENCH,
+        OPT_PRIORITY,
+        OPT_CHAIN,
+        OPT_MODE,
+        OPT_TC,
+        OPT_EGRESS_PACKETS,
+        OPT_EGRESS_HOSTS,
+        OPT_PIN_PATH,
+        OPT_SNAPSHOT,
+        OPT_CONTROL,
+        OPT_CONFIG,
+        OPT_METRICS_PORT,
+        OPT_SELFTEST,
+};
+
+/* A --rate override: SYNs per second (and burst, or zero for --syn-burst)
+ * for a source address or prefix. addr is in host byte order. */
+struct rate_rule {
+        unsigned int addr;
+        unsigned int prefixlen;
+        double pps;
+        long burst;
+};
+
+/* A TC classifier we attached, and whether we made the clsact qdisc it
+ * hangs off. */
+struct tc_link {
+        struct bpf_tc_hook hook;
+        struct bpf_tc_opts opts;
+        bool attached;
+        bool created;
+};
+
+/* Everything we attached to one -i interface. */
+struct iface {
+        const char *name;
+        unsigned int ifindex;
+        bool xdp_attached;
+        struct tc_link ingress;
+        struct tc_link egress;
+};
+
 static struct env {
 	enum Level level;
 	long num_packets;
+        long num_hosts;
         long time_period;
-        char *interface;
+        char *interfaces[MAX_INTERFACES];
+        int num_interfaces;
+        long sketch_promote;
+        long port_sources;
+        long prefix_packets;
+        long prefix_len;
+        bool per_destination;
+        struct {
+                long period;
+                long threshold;
+        } windows[MAX_WINDOWS];
+        int num_windows;
+        enum Estimator estimator;
+        char *replay;
+        char *record;
+        double syn_rate;
+        long syn_burst;
+        struct rate_rule rates[MAX_RATES];
+        int num_rates;
+        double syncookie_rate;
+        struct port_policy ports[PORT_POLICY_ENTRIES];
+        bool port_filter;
+        long closed_weight;
+        bool listener_aware;
+        bool drop_flags[PATTERN_MAX];
+        long udp_packets;
+        long icmp_packets;
+        char *allowlist_file;
+        char *threat_file;
+        char *blocklist_file;
+        bool bench;
+        bool selftest;
+        long priority;
+        unsigned int chain;
+        bool chain_set;
+        enum xdp_attach_mode mode;
+        bool tc;
+        long egress_packets;
+        long egress_hosts;
+        char *pin_path;
+        char *snapshot;
+        char *control;
+        char *config;
+        long metrics_port;
 } env;
 
+/* env as the command line left it, before --config. A reload starts over
+ * from here. */
+static struct env cmdline;
+
+/* A coarser sliding window. Its tables map hosts to struct window_count and
+ * are only ever fed whole completed periods of the window below it (or of
+ * -t, for the first one), so keeping several of them costs nothing per
+ * event. */
+struct window {
+        long period;
+        long threshold;
+        /* Seconds of the current period covered by completed periods of the
+         * window below. */
+        long elapsed;
+        apr_hash_t *prev;
+        apr_hash_t *curr;
+        apr_pool_t *prev_pool;
+        apr_pool_t *curr_pool;
+};
+
+/* A host's ports in one period of a coarser window. The same port in two
+ * periods of the window below is still one port, so they're kept as a
+ * HyperLogLog, which merges. extra is what was only ever counted, not
+ * seen: SYNs from before promotion, closed port weight and restored
+ * counts. */
+struct window_count {
+        struct hll ports;
+        unsigned int extra;
+};
+
 struct context {
         apr_hash_t *prev;
         apr_hash_t *curr;
         apr_pool_t *prev_pool;
         apr_pool_t *curr_pool;
         int sample_fd;
+        int allowlist_fd;
         int blacklist_fd;
+        int threat_bloom_fd;
+        int threatlist_fd;
+        int threat_prefixes_fd;
+        /* threat_bloom is a queue, for kernels without Bloom filters. */
+        bool threat_queue;
+        int prefix_blacklist_fd;
+        int settings_fd;
+        int host_rates_fd;
+        int prefix_rates_fd;
+        int stats_fd;
+        int port_policy_fd;
+        int flag_policy_fd;
+        int flag_drops_fd;
+        int egress_blacklist_fd;
+        apr_hash_t *port_prev;
+        apr_hash_t *port_curr;
+        apr_hash_t *prefix_prev;
+        apr_hash_t *prefix_curr;
+        apr_hash_t *flood_prev;
+        apr_hash_t *flood_curr;
+        /* Hosts over a flood threshold in this measurement pass. */
+        apr_hash_t *flooding;
+        struct sketch *flood_sketch;
+        /* Outbound SYNs from our own hosts. */
+        apr_hash_t *egress_prev;
+        apr_hash_t *egress_curr;
+        struct sketch *egress_sketch;
+        struct sketch *sketch;
+        struct topk *topk;
+        struct window windows[MAX_WINDOWS];
+        int num_windows;
+        apr_hash_t *decay;
+        /* CLOCK_MONOTONIC nanoseconds, as of the event or timer being
+         * handled. Replays set this from the trace instead. */
+        unsigned long long now;
+        unsigned long long period_start;
+        FILE *record;
+        /* SYN cookie mode, and the SYN counter as of the last measurement. */
+        bool syncookies;
+        unsigned long long last_syns;
+        int calm;
+        /* Latency of each part of the loop, by enum timing. */
+        struct hist *timings;
+        /* How long events sat in the ring buffer before we got to them. */
+        struct hist *event_age;
+        /* The ring buffer's consumer and producer positions, mapped
+         * read-only, so the backlog can be read without a syscall. */
+        const unsigned long *ring_consumer;
+        const unsigned long *ring_producer;
+        unsigned long ring_size;
+        unsigned long ring_backlog_max;
+        unsigned long long last_lost;
 } context;
 
 struct element {
         struct apr_skiplist *list;
+        struct apr_skiplist *dests;
         unsigned int dest;
+        unsigned int missed;
+        /* Extra weight for new ports that are never legitimately open. */
+        unsigned int closed;
+        /* Counts from before a restart, restored from a snapshot. */
+        unsigned int restored;
+        unsigned int restored_dests;
 } element;
 
+/* Per-host state for the decayed estimator: an exponentially decayed count
+ * of new ports, as of last. */
+struct decay_elem {
+        unsigned int host;
+        unsigned int dest;
+        double count;
+        unsigned long long last;
+        unsigned short recent[DECAY_RECENT_PORTS];
+        unsigned int next;
+};
+
+/* Key for the per-port aggregation. dest is zero unless we aggregate per
+ * destination address as well. */
+struct port_key {
+        unsigned int dest;
+        unsigned int port;
+};
+
+/* Everything a destination port received in one time period, from every
+ * source, promoted or not. */
+struct port_stat {
+        struct port_key key;
+        unsigned int syns;
+        struct hll sources;
+        bool swept;
+};
+
+/* Key for the per-source flood counters. port is zero for ICMP. */
+struct flood_key {
+        unsigned int host;
+        unsigned short port;
+        unsigned short proto;
+};
+
+struct egress_stat {
+        unsigned int host;
+        unsigned int syns;
+        /* Distinct destinations. */
+        struct hll dests;
+        bool blocked;
+        /* Blocked by a previous run, which knew why. */
+        bool adopted;
+};
+
+struct flood_stat {
+        struct flood_key key;
+        unsigned int packets;
+        bool adopted;
+};
+
+/* Number of /N prefixes we keep SYN counts for per time period. Past this,
+ * a spoofed flood from all over the address space isn't going to be stopped
+ * by prefix blocks anyway. */
+#define MAX_PREFIXES 65536
+
 const char *argp_program_version = "xdpfilter 0.2.0";
 const char *argp_program_bug_address = "<david@davidfluck.com>";
 const char argp_program_doc[] =
 "XDP rate limiter application.\n"
 "\n"
 "Watches incoming traffic for SYN requests, and drops packets if it detects "
-"more than -n SYN packets in the last -t seconds on -i interface.\n"
+"more than -n SYN packets in the last -t seconds on -i interface, or SYN "
+"packets to more than -d of our hosts.\n"
+"\n"
+"Additional, longer windows with their own thresholds can be added with -w, "
+"to catch slow scans that never trip -n.\n"
 "\n"
-"USAGE: ./xdpfilter [-n <num-SYN-packets>] [-t <time-period-seconds>] [-i <interface-name> ] [-v]\n";
+"USAGE: ./xdpfilter [-n <num-SYN-packets>] [-d <num-hosts>] [-t <time-period-seconds>] [-w <seconds>:<num-SYN-packets>]... [-i <interface-name>[,...] ] [-v]\n";
 
 static const struct argp_option opts[] = {
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
 	{ "num-packets", 'n', "NUM", 0, "Number of SYN packets to trigger on." },
+	{ "num-hosts", 'd', "NUM", 0, "Number of distinct destination hosts to trigger on." },
 	{ "time-period", 't', "SECONDS", 0, "The previous interval, in seconds, to scan."},
-        { "interface", 'i', "IFNAME", 0, "The interface name to attach to (e.g. eth0)."},
+	{ "window", 'w', "SECONDS:NUM", 0, "Also trigger on more than NUM SYN packets in the last SECONDS, which must be a multiple of the next shorter window. May be given more than once."},
+        { "interface", 'i', "IFNAME", 0, "The interface name to attach to (e.g. eth0). A comma-separated list attaches to all of them, with one blacklist for all. May be given more than once."},
+        { "port-sources", OPT_PORT_SOURCES, "NUM", 0, "Number of distinct sources sending SYNs to one port that counts as a distributed scan (default 0, off)."},
+        { "prefix-packets", OPT_PREFIX_PACKETS, "NUM", 0, "Number of SYNs from one prefix to a port under distributed scan before the whole prefix is blocked (default 0, off)."},
+        { "prefix-len", OPT_PREFIX_LEN, "BITS", 0, "Length of the prefixes blocked during a distributed scan."},
+        { "per-destination", OPT_PER_DESTINATION, NULL, 0, "Aggregate distributed scans per destination address and port, rather than per port."},
+        { "estimator", OPT_ESTIMATOR, "NAME", 0, "How per-host rates are estimated: window (previous and current time periods) or decay (exponentially decayed counters, no rotation)."},
+        { "syn-rate", OPT_SYN_RATE, "PPS", 0, "Drop SYNs from any one source beyond PPS per second, in the XDP program (0 for no limit)."},
+        { "syn-burst", OPT_SYN_BURST, "NUM", 0, "Number of back-to-back SYNs a source may send before --syn-rate applies."},
+        { "rate", OPT_RATE, "ADDR[/LEN]:PPS[:BURST]", 0, "Use a different SYN rate for a source address or prefix. May be given more than once."},
+        { "protect-ports", OPT_PROTECT_PORTS, "PORTS", 0, "Only SYNs to these ports (e.g. 22,80,8000-8099) or --closed-ports are tracked; the rest pass without an event. May be given more than once."},
+        { "closed-ports", OPT_CLOSED_PORTS, "PORTS", 0, "Ports nothing legitimate ever connects to. SYNs to them count --closed-weight times towards -n. May be given more than once."},
+        { "closed-weight", OPT_CLOSED_WEIGHT, "NUM", 0, "How many ports a SYN to one of --closed-ports counts as."},
+        { "listener-aware", OPT_LISTENER_AWARE, NULL, 0, "Only count SYNs to ports nothing is listening on, so clients of our own services are never blocked."},
+        { "drop-flags", OPT_DROP_FLAGS, "PATTERNS", 0, "Drop stealth scans with these TCP flag patterns in the XDP program: a comma-separated list of null, fin, xmas, synfin, synrst, illegal or all."},
+        { "udp-packets", OPT_UDP_PACKETS, "NUM", 0, "Block sources sending more than NUM UDP packets to one port in the last -t seconds (0 to ignore UDP)."},
+        { "icmp-packets", OPT_ICMP_PACKETS, "NUM", 0, "Block sources sending more than NUM ICMP echo requests in the last -t seconds (0 to ignore ICMP)."},
+        { "allowlist-file", OPT_ALLOWLIST_FILE, "FILE", 0, "Never count or block the addresses and prefixes in FILE, one per line."},
+        { "threat-file", OPT_THREAT_FILE, "FILE", 0, "Drop everything from the addresses in FILE, one per line. Meant for large threat intelligence feeds."},
+        { "blocklist-file", OPT_BLOCKLIST_FILE, "FILE", 0, "Drop everything from the addresses and prefixes (e.g. 192.0.2.0/24) in FILE, one per line. Loaded in bulk at startup, like --threat-file."},
+        { "priority", OPT_PRIORITY, "NUM", 0, "Run priority in the libxdp dispatcher, when sharing the interface with other XDP programs. Lower runs first (default 10)."},
+        { "chain", OPT_CHAIN, "ACTIONS", 0, "Which of our verdicts hand the packet on to the next XDP program: a comma-separated list of aborted, drop, pass, tx, redirect, or none (default pass)."},
+        { "mode", OPT_MODE, "MODE", 0, "How to attach: skb (generic, the default) or native (in the driver). Every program on an interface has to use the same mode."},
+        { "egress-packets", OPT_EGRESS_PACKETS, "NUM", 0, "Watch outbound SYNs too, and stop our own hosts from opening connections once they send more than NUM SYNs in the last -t seconds."},
+        { "egress-hosts", OPT_EGRESS_HOSTS, "NUM", 0, "Watch outbound SYNs too, and stop our own hosts from opening connections once they send SYNs to more than NUM distinct hosts in the last -t seconds."},
+        { "pin-path", OPT_PIN_PATH, "DIR", 0, "Pin the blacklists and the XDP link under DIR in bpffs (e.g. /sys/fs/bpf/xdpfilter), and leave them in place on exit. A later run with the same DIR picks them up and swaps its program in atomically."},
+        { "snapshot", OPT_SNAPSHOT, "FILE", 0, "Save the per-host counts to FILE every second and on exit, and pick them up from there on startup, so a restart doesn't reset anyone's window."},
+        { "control", OPT_CONTROL, "PATH", 0, "Listen for commands on a Unix socket at PATH: top, query ADDR, block ADDR[/LEN], unblock ADDR[/LEN], get NAME and set NAME NUM, one per line, or the binary protocol in control.h."},
+        { "config", OPT_CONFIG, "FILE", 0, "Read more options from FILE, one per line, as NAME VALUE without the dashes. Thresholds, -t, rates, port and flag policy are read again on SIGHUP."},
+        { "metrics-port", OPT_METRICS_PORT, "PORT", 0, "Serve Prometheus metrics on 127.0.0.1:PORT: latency of each stage of the event loop, and the data-plane counters."},
+        { "tc", OPT_TC, NULL, 0, "Attach as a TC ingress classifier instead of an XDP program, for interfaces where XDP doesn't work. No SYN cookies."},
+        { "bench", OPT_BENCH, NULL, 0, "Don't attach anything. Measure the per-packet cost of the XDP program and the TC classifier for threat lists of increasing size."},
+        { "selftest", OPT_SELFTEST, NULL, 0, "Don't attach anything. Feed the estimator a spoofed SYN flood, run SYN cookie mode against test packets, and exit with 0 if both do as they should."},
+        { "syncookie-rate", OPT_SYNCOOKIE_RATE, "PPS", 0, "Answer SYNs with SYN cookies in the XDP program while more than PPS SYNs per second arrive in total (0 to never). Needs Linux 6.0 and net.ipv4.tcp_syncookies=2."},
+        { "record", OPT_RECORD, "FILE", 0, "Append every event to FILE as a trace for --replay."},
+        { "replay", OPT_REPLAY, "FILE", 0, "Don't attach anything. Replay a trace through both estimators and compare them against exact counts."},
+        { "sketch-promote", OPT_SKETCH_PROMOTE, "NUM", 0, "SYNs a host must send in a time period, over what the sketch gives everyone, before it gets exact per-host tracking."},
         { 0 }
 };
 
@@ -76,7 +442,211 @@ static void dlog(FILE* stream, enum Level level, const char *fmt, ...)
         }
 }
 
-static error_t parse_arg(int key, char *arg, struct argp_state *state)
+/* Parse "a.b.c.d" or "a.b.c.d/len" into a host byte order address, with the
+ * host bits cleared, and a prefix length. */
+static int parse_cidr(const char *str, unsigned int *addr, unsigned int *prefixlen)
+{
+        char buf[INET_ADDRSTRLEN + 4];
+        struct in_addr in;
+        char *slash, *end;
+        long len = 32;
+
+        if (strlen(str) >= sizeof(buf)) {
+                return -1;
+        }
+
+        strcpy(buf, str);
+
+        slash = strchr(buf, '/');
+        if (slash) {
+                *slash = '\0';
+                errno = 0;
+                len = strtol(slash + 1, &end, 10);
+                if (errno || *end || slash[1] == '\0' || len < 0 || len > 32) {
+                        return -1;
+                }
+        }
+
+        if (inet_pton(AF_INET, buf, &in) != 1) {
+                return -1;
+        }
+
+        *prefixlen = len;
+        *addr = ntohl(in.s_addr) & (len ? ~0U << (32 - len) : 0);
+
+        return 0;
+}
+
+/* Names for --drop-flags, by enum flag_pattern. */
+static const char *pattern_names[PATTERN_MAX] = {
+        [PATTERN_OK] = "ok",
+        [PATTERN_NULL] = "null",
+        [PATTERN_FIN] = "fin",
+        [PATTERN_XMAS] = "xmas",
+        [PATTERN_SYNFIN] = "synfin",
+        [PATTERN_SYNRST] = "synrst",
+        [PATTERN_ILLEGAL] = "illegal",
+};
+
+/* Which scan a TCP flags byte belongs to, if any. ECE and CWR don't matter
+ * either way. Everything after the handshake carries ACK, so the only flags
+ * that can legitimately turn up without it are a lone SYN or an RST. */
+static enum flag_pattern flag_pattern(unsigned char flags)
+{
+        flags &= TH_FIN | TH_SYN | TH_RST | TH_PUSH | TH_ACK | TH_URG;
+
+        if (!flags) {
+                return PATTERN_NULL;
+        }
+
+        if ((flags & (TH_SYN | TH_FIN)) == (TH_SYN | TH_FIN)) {
+                return PATTERN_SYNFIN;
+        }
+
+        if ((flags & (TH_SYN | TH_RST)) == (TH_SYN | TH_RST)) {
+                return PATTERN_SYNRST;
+        }
+
+        if (flags == (TH_FIN | TH_PUSH | TH_URG)) {
+                return PATTERN_XMAS;
+        }
+
+        if (flags == TH_FIN) {
+                return PATTERN_FIN;
+        }
+
+        if (!(flags & TH_ACK) && flags != TH_SYN && !(flags & TH_RST)) {
+                return PATTERN_ILLEGAL;
+        }
+
+        if ((flags & (TH_FIN | TH_RST)) == (TH_FIN | TH_RST)) {
+                return PATTERN_ILLEGAL;
+        }
+
+        return PATTERN_OK;
+}
+
+/* XDP verdicts by value, for --chain. */
+static const char *action_names[] = {
+        [XDP_ABORTED] = "aborted",
+        [XDP_DROP] = "drop",
+        [XDP_PASS] = "pass",
+        [XDP_TX] = "tx",
+        [XDP_REDIRECT] = "redirect",
+};
+
+/* Parse a --chain list into env.chain, one bit per action. */
+static int parse_actions(const char *str)
+{
+        char buf[128];
+        char *saveptr;
+
+        if (strlen(str) >= sizeof(buf)) {
+                return -1;
+        }
+
+        strcpy(buf, str);
+        env.chain = 0;
+
+        for (char *name = strtok_r(buf, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+                bool found = !strcmp(name, "none");
+
+                for (unsigned int i = 0; i <= XDP_REDIRECT; i++) {
+                        if (!strcmp(name, action_names[i])) {
+                                env.chain |= 1U << i;
+                                found = true;
+                        }
+                }
+
+                if (!found) {
+                        return -1;
+                }
+        }
+
+        env.chain_set = true;
+
+        return 0;
+}
+
+/* Parse a --drop-flags list into env.drop_flags. */
+static int parse_patterns(const char *str)
+{
+        char buf[128];
+        char *saveptr;
+
+        if (strlen(str) >= sizeof(buf)) {
+                return -1;
+        }
+
+        strcpy(buf, str);
+
+        for (char *name = strtok_r(buf, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+                bool all = !strcmp(name, "all");
+                bool found = all;
+
+                for (int i = PATTERN_OK + 1; i < PATTERN_MAX; i++) {
+                        if (all || !strcmp(name, pattern_names[i])) {
+                                env.drop_flags[i] = true;
+                                found = true;
+                        }
+                }
+
+                if (!found) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/* Mark a comma-separated list of ports and port ranges, like
+ * "22,80,8000-8099", as protected or closed in env.ports. */
+static int parse_ports(const char *str, bool closed)
+{
+        const char *p = str;
+
+        while (*p) {
+                char *end;
+                long first, last;
+
+                errno = 0;
+                first = last = strtol(p, &end, 10);
+                if (end == p) {
+                        return -1;
+                }
+
+                if (*end == '-') {
+                        p = end + 1;
+                        last = strtol(p, &end, 10);
+                        if (end == p) {
+                                return -1;
+                        }
+                }
+
+                if (errno || first < 0 || last > 65535 || first > last || (*end && *end != ',')) {
+                        return -1;
+                }
+
+                for (long port = first; port <= last; port++) {
+                        struct port_policy *policy = &env.ports[port / 32];
+                        unsigned int bit = 1U << (port % 32);
+
+                        if (closed) {
+                                policy->closed |= bit;
+                        } else {
+                                policy->protect |= bit;
+                        }
+                }
+
+                p = *end ? end + 1 : end;
+        }
+
+        return 0;
+}
+
+/* Set one option from its argument, for the command line and --config
+ * alike. Complains and returns EINVAL if the argument is no good. */
+static error_t set_option(int key, char *arg)
 {
 	switch (key) {
 	case 'v':
@@ -87,7 +657,15 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
                 env.num_packets = strtol(arg, NULL, 10);
                 if (errno || env.num_packets <= 0) {
                         dlog(stderr, INFO, "Invalid number of packets: %s\n", arg);
-                        argp_usage(state);
+                        return EINVAL;
+                }
+		break;
+        case 'd':
+                errno = 0;
+                env.num_hosts = strtol(arg, NULL, 10);
+                if (errno || env.num_hosts <= 0) {
+                        dlog(stderr, INFO, "Invalid number of hosts: %s\n", arg);
+                        return EINVAL;
                 }
 		break;
         case 't':
@@ -95,46 +673,470 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
                 env.time_period = strtol(arg, NULL, 10);
                 if (errno || env.time_period <= 0) {
                         dlog(stderr, INFO, "Invalid time period: %s\n", arg);
-                        argp_usage(state);
+                        return EINVAL;
                 }
 		break;
-        case 'i':
-                env.interface = arg;
-                break;
-	case ARGP_KEY_ARG:
-		argp_usage(state);
+        case 'w': {
+                char *end;
+
+                if (env.num_windows == MAX_WINDOWS) {
+                        dlog(stderr, INFO, "Too many windows, at most %d are supported\n", MAX_WINDOWS);
+                        return EINVAL;
+                }
+
+                errno = 0;
+                env.windows[env.num_windows].period = strtol(arg, &end, 10);
+                if (errno || *end != ':' || env.windows[env.num_windows].period <= 0) {
+                        dlog(stderr, INFO, "Invalid window: %s\n", arg);
+                        return EINVAL;
+                }
+
+                env.windows[env.num_windows].threshold = strtol(end + 1, &end, 10);
+                if (errno || *end || env.windows[env.num_windows].threshold <= 0) {
+                        dlog(stderr, INFO, "Invalid window: %s\n", arg);
+                        return EINVAL;
+                }
+
+                env.num_windows++;
 		break;
+        }
+        case 'i': {
+                char *saveptr;
+
+                for (char *name = strtok_r(arg, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+                        if (env.num_interfaces == MAX_INTERFACES) {
+                                dlog(stderr, INFO, "Too many interfaces (at most %d)\n", MAX_INTERFACES);
+                                return EINVAL;
+                        }
+
+                        env.interfaces[env.num_interfaces++] = name;
+                }
+                break;
+        }
+        case OPT_PORT_SOURCES:
+                errno = 0;
+                env.port_sources = strtol(arg, NULL, 10);
+                if (errno || env.port_sources < 0) {
+                        dlog(stderr, INFO, "Invalid number of sources: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_PREFIX_PACKETS:
+                errno = 0;
+                env.prefix_packets = strtol(arg, NULL, 10);
+                if (errno || env.prefix_packets < 0) {
+                        dlog(stderr, INFO, "Invalid number of prefix packets: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_PREFIX_LEN:
+                errno = 0;
+                env.prefix_len = strtol(arg, NULL, 10);
+                if (errno || env.prefix_len <= 0 || env.prefix_len > 32) {
+                        dlog(stderr, INFO, "Invalid prefix length: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_PER_DESTINATION:
+                env.per_destination = true;
+                break;
+        case OPT_ESTIMATOR:
+                if (!strcmp(arg, "window")) {
+                        env.estimator = WINDOW;
+                } else if (!strcmp(arg, "decay")) {
+                        env.estimator = DECAY;
+                } else {
+                        dlog(stderr, INFO, "Invalid estimator: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_REPLAY:
+                env.replay = arg;
+                break;
+        case OPT_RECORD:
+                env.record = arg;
+                break;
+        case OPT_SYN_RATE:
+                errno = 0;
+                env.syn_rate = strtod(arg, NULL);
+                if (errno || env.syn_rate < 0) {
+                        dlog(stderr, INFO, "Invalid SYN rate: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_PROTECT_PORTS:
+        case OPT_CLOSED_PORTS:
+                if (parse_ports(arg, key == OPT_CLOSED_PORTS)) {
+                        dlog(stderr, INFO, "Invalid port list: %s\n", arg);
+                        return EINVAL;
+                }
+                if (key == OPT_PROTECT_PORTS) {
+                        env.port_filter = true;
+                }
+                break;
+        case OPT_THREAT_FILE:
+                env.threat_file = arg;
+                break;
+        case OPT_BLOCKLIST_FILE:
+                env.blocklist_file = arg;
+                break;
+        case OPT_BENCH:
+                env.bench = true;
+                break;
+        case OPT_SELFTEST:
+                env.selftest = true;
+                break;
+        case OPT_TC:
+                env.tc = true;
+                break;
+        case OPT_PIN_PATH:
+                env.pin_path = arg;
+                break;
+        case OPT_SNAPSHOT:
+                env.snapshot = arg;
+                break;
+        case OPT_CONTROL:
+                env.control = arg;
+                break;
+        case OPT_CONFIG:
+                env.config = arg;
+                break;
+        case OPT_METRICS_PORT:
+                errno = 0;
+                env.metrics_port = strtol(arg, NULL, 10);
+                if (errno || env.metrics_port <= 0 || env.metrics_port > 65535) {
+                        dlog(stderr, INFO, "Invalid metrics port: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_EGRESS_PACKETS:
+                errno = 0;
+                env.egress_packets = strtol(arg, NULL, 10);
+                if (errno || env.egress_packets < 0) {
+                        dlog(stderr, INFO, "Invalid number of egress packets: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_EGRESS_HOSTS:
+                errno = 0;
+                env.egress_hosts = strtol(arg, NULL, 10);
+                if (errno || env.egress_hosts < 0) {
+                        dlog(stderr, INFO, "Invalid number of egress hosts: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_PRIORITY:
+                errno = 0;
+                env.priority = strtol(arg, NULL, 10);
+                if (errno || env.priority < 0) {
+                        dlog(stderr, INFO, "Invalid priority: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_CHAIN:
+                if (parse_actions(arg)) {
+                        dlog(stderr, INFO, "Invalid chain actions: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_MODE:
+                if (!strcmp(arg, "skb")) {
+                        env.mode = XDP_MODE_SKB;
+                } else if (!strcmp(arg, "native")) {
+                        env.mode = XDP_MODE_NATIVE;
+                } else {
+                        dlog(stderr, INFO, "Invalid attach mode: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_ALLOWLIST_FILE:
+                env.allowlist_file = arg;
+                break;
+        case OPT_UDP_PACKETS:
+                errno = 0;
+                env.udp_packets = strtol(arg, NULL, 10);
+                if (errno || env.udp_packets < 0) {
+                        dlog(stderr, INFO, "Invalid number of UDP packets: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_ICMP_PACKETS:
+                errno = 0;
+                env.icmp_packets = strtol(arg, NULL, 10);
+                if (errno || env.icmp_packets < 0) {
+                        dlog(stderr, INFO, "Invalid number of ICMP packets: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_DROP_FLAGS:
+                if (parse_patterns(arg)) {
+                        dlog(stderr, INFO, "Invalid flag patterns: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_LISTENER_AWARE:
+                env.listener_aware = true;
+                break;
+        case OPT_CLOSED_WEIGHT:
+                errno = 0;
+                env.closed_weight = strtol(arg, NULL, 10);
+                if (errno || env.closed_weight <= 0) {
+                        dlog(stderr, INFO, "Invalid closed port weight: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_SYNCOOKIE_RATE:
+                errno = 0;
+                env.syncookie_rate = strtod(arg, NULL);
+                if (errno || env.syncookie_rate < 0) {
+                        dlog(stderr, INFO, "Invalid SYN cookie rate: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_SYN_BURST:
+                errno = 0;
+                env.syn_burst = strtol(arg, NULL, 10);
+                if (errno || env.syn_burst <= 0) {
+                        dlog(stderr, INFO, "Invalid SYN burst: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
+        case OPT_RATE: {
+                struct rate_rule *rule = &env.rates[env.num_rates];
+                char *end;
+
+                if (env.num_rates == MAX_RATES) {
+                        dlog(stderr, INFO, "Too many rates, at most %d are supported\n", MAX_RATES);
+                        return EINVAL;
+                }
+
+                end = strchr(arg, ':');
+                if (!end) {
+                        dlog(stderr, INFO, "Invalid rate: %s\n", arg);
+                        return EINVAL;
+                }
+
+                *end = '\0';
+                if (parse_cidr(arg, &rule->addr, &rule->prefixlen)) {
+                        dlog(stderr, INFO, "Invalid address: %s\n", arg);
+                        return EINVAL;
+                }
+
+                errno = 0;
+                rule->pps = strtod(end + 1, &end);
+                rule->burst = 0;
+                if (!errno && *end == ':') {
+                        rule->burst = strtol(end + 1, &end, 10);
+                }
+                if (errno || *end || rule->pps < 0 || rule->burst < 0) {
+                        dlog(stderr, INFO, "Invalid rate for %s\n", arg);
+                        return EINVAL;
+                }
+
+                env.num_rates++;
+                break;
+        }
+        case OPT_SKETCH_PROMOTE:
+                errno = 0;
+                env.sketch_promote = strtol(arg, NULL, 10);
+                if (errno || env.sketch_promote <= 0) {
+                        dlog(stderr, INFO, "Invalid sketch promotion threshold: %s\n", arg);
+                        return EINVAL;
+                }
+                break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
 	return 0;
 }
 
-static const struct argp argp = {
-	.options = opts,
-	.parser = parse_arg,
-	.doc = argp_program_doc,
-};
-
-static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
 {
-	if (level == LIBBPF_DEBUG && env.level != DEBUG) {
-		return 0;
+        error_t err;
+
+        if (key == ARGP_KEY_ARG) {
+                argp_usage(state);
+                return 0;
         }
-	return vfprintf(stderr, format, args);
-}
 
-static void bump_memlock_rlimit(void)
-{
-	struct rlimit rlim_new = {
-		.rlim_cur = RLIM_INFINITY,
-		.rlim_max = RLIM_INFINITY,
-	};
+        err = set_option(key, arg);
+        if (err && err != ARGP_ERR_UNKNOWN) {
+                argp_usage(state);
+        }
 
-	if (setrlimit(RLIMIT_MEMLOCK, &rlim_new)) {
-		dlog(stderr, INFO, "Failed to increase RLIMIT_MEMLOCK limit!\n");
-		exit(1);
-	}
+        return err;
+}
+
+static int window_compare(const void *a, const void *b)
+{
+        return (*(const long *)a > *(const long *)b) - (*(const long *)a < *(const long *)b);
+}
+
+/* Each window is built from completed periods of the next shorter one, so
+ * the periods have to nest. */
+static int check_windows(void)
+{
+        long shorter = env.time_period;
+
+        qsort(env.windows, env.num_windows, sizeof(env.windows[0]), window_compare);
+
+        for (int i = 0; i < env.num_windows; i++) {
+                if (env.windows[i].period <= shorter || env.windows[i].period % shorter) {
+                        dlog(stderr, INFO, "Window of %lds is not a multiple of %lds\n",
+                             env.windows[i].period, shorter);
+                        return -1;
+                }
+
+                shorter = env.windows[i].period;
+        }
+
+        return 0;
+}
+
+/* Options that can change on SIGHUP. Everything else is baked into the
+ * maps or the program at startup. */
+static bool reloadable(int key)
+{
+        switch (key) {
+        case 'v':
+        case 'n':
+        case 'd':
+        case 't':
+        case OPT_PORT_SOURCES:
+        case OPT_PREFIX_PACKETS:
+        case OPT_SYN_RATE:
+        case OPT_SYN_BURST:
+        case OPT_RATE:
+        case OPT_PROTECT_PORTS:
+        case OPT_CLOSED_PORTS:
+        case OPT_CLOSED_WEIGHT:
+        case OPT_LISTENER_AWARE:
+        case OPT_DROP_FLAGS:
+        case OPT_UDP_PACKETS:
+        case OPT_ICMP_PACKETS:
+                return true;
+        default:
+                return false;
+        }
+}
+
+/* Put the reloadable options back the way the command line had them. */
+static void reset_reloadable(const struct env *from)
+{
+        env.level = from->level;
+        env.num_packets = from->num_packets;
+        env.num_hosts = from->num_hosts;
+        env.time_period = from->time_period;
+        env.port_sources = from->port_sources;
+        env.prefix_packets = from->prefix_packets;
+        env.syn_rate = from->syn_rate;
+        env.syn_burst = from->syn_burst;
+        memcpy(env.rates, from->rates, sizeof(env.rates));
+        env.num_rates = from->num_rates;
+        memcpy(env.ports, from->ports, sizeof(env.ports));
+        env.port_filter = from->port_filter;
+        env.closed_weight = from->closed_weight;
+        env.listener_aware = from->listener_aware;
+        memcpy(env.drop_flags, from->drop_flags, sizeof(env.drop_flags));
+        env.udp_packets = from->udp_packets;
+        env.icmp_packets = from->icmp_packets;
+}
+
+/* Apply a --config file: long options without the dashes, one per line, as
+ * "num-packets 50" or "num-packets = 50", with # comments. Lists add to the
+ * command line's, and everything else overrides it. On a reload, options
+ * that can't change without a restart are skipped. */
+static int read_config(const char *path, bool reloading)
+{
+        FILE *f = fopen(path, "r");
+        char line[512];
+        int lineno = 0;
+
+        if (!f) {
+                dlog(stderr, INFO, "Failed to open %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                char *name = line + strspn(line, " \t");
+                const struct argp_option *opt;
+                char *value, *end;
+
+                lineno++;
+
+                name[strcspn(name, "#\r\n")] = '\0';
+                end = name + strlen(name);
+                while (end > name && (end[-1] == ' ' || end[-1] == '\t')) {
+                        *--end = '\0';
+                }
+
+                if (!*name) {
+                        continue;
+                }
+
+                value = name + strcspn(name, " \t=");
+                if (*value) {
+                        *value++ = '\0';
+                        value += strspn(value, " \t=");
+                }
+
+                for (opt = opts; opt->name && strcmp(opt->name, name); opt++) {
+                }
+
+                if (!opt->name || opt->key == OPT_CONFIG || !opt->arg != !*value) {
+                        dlog(stderr, INFO, "%s:%d: Invalid option: %s\n", path, lineno, name);
+                        fclose(f);
+                        return -1;
+                }
+
+                if (reloading && !reloadable(opt->key)) {
+                        dlog(stdout, DEBUG, "%s:%d: %s only changes on restart\n", path, lineno, name);
+                        continue;
+                }
+
+                /* Some options keep pointers into their arguments, like the
+                 * command line's, so at startup ours have to stay around. */
+                if (opt->arg && !reloading) {
+                        value = strdup(value);
+                }
+
+                if (set_option(opt->key, opt->arg ? value : NULL)) {
+                        dlog(stderr, INFO, "%s:%d: Invalid option: %s\n", path, lineno, name);
+                        fclose(f);
+                        return -1;
+                }
+        }
+
+        fclose(f);
+
+        return 0;
+}
+
+static const struct argp argp = {
+	.options = opts,
+	.parser = parse_arg,
+	.doc = argp_program_doc,
+};
+
+static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG && env.level != DEBUG) {
+		return 0;
+        }
+	return vfprintf(stderr, format, args);
+}
+
+static void bump_memlock_rlimit(void)
+{
+	struct rlimit rlim_new = {
+		.rlim_cur = RLIM_INFINITY,
+		.rlim_max = RLIM_INFINITY,
+	};
+
+	if (setrlimit(RLIMIT_MEMLOCK, &rlim_new)) {
+		dlog(stderr, INFO, "Failed to increase RLIMIT_MEMLOCK limit!\n");
+		exit(1);
+	}
 }
 
 static volatile bool exiting = false;
@@ -144,6 +1146,32 @@ static void sig_handler(int sig)
 	exiting = true;
 }
 
+static volatile bool reload = false;
+
+static void hup_handler(int sig)
+{
+        reload = true;
+}
+
+static unsigned long long monotonic_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Wall clock, for anything that has to make sense across a reboot. */
+static unsigned long long realtime_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
 int skiplist_compare(void *a, void*b)
 {
         if (*(unsigned int *)a < *(unsigned int *)b) {
@@ -155,6 +1183,18 @@ int skiplist_compare(void *a, void*b)
         }
 }
 
+/* Ports are only two bytes wide, so they need their own comparison. */
+int port_compare(void *a, void *b)
+{
+        if (*(unsigned short *)a < *(unsigned short *)b) {
+                return -1;
+        } else if (*(unsigned short *)a == *(unsigned short *)b) {
+                return 0;
+        } else {
+                return 1;
+        }
+}
+
 /* This might be bad, but because we don't plan to actually remove anything from
  * the skiplists, and because the pool will take care of cleanup anyway, we
  * don't bother defining a proper free function. This is a NOP to satisfy the
@@ -165,188 +1205,3466 @@ void skiplist_free(void *elem)
         return;
 }
 
-static int handle_event(void *ctx, void *data, size_t data_sz)
+/* Add the time since start to the histogram for one part of the loop. */
+static void record_time(struct context *ctx, enum timing timing, unsigned long long start)
+{
+        hist_record(&ctx->timings[timing], monotonic_ns() - start);
+}
+
+/* Is host covered by the allowlist? */
+static bool host_allowed(struct context *ctx, unsigned int host)
+{
+        unsigned long long start = monotonic_ns();
+        unsigned char dummy;
+        struct prefix_key pkey = {
+                .prefixlen = 32,
+                .addr = htonl(host),
+        };
+        bool allowed = !bpf_map_lookup_elem(ctx->allowlist_fd, &pkey, &dummy);
+
+        record_time(ctx, TIME_MAP_LOOKUP, start);
+
+        return allowed;
+}
+
+/* Is host in blacklist for reason? */
+static bool host_blocked(struct context *ctx, unsigned int host, unsigned char reason)
+{
+        unsigned long long start = monotonic_ns();
+        unsigned char reasons = 0;
+
+        bpf_map_lookup_elem(ctx->blacklist_fd, &host, &reasons);
+        record_time(ctx, TIME_MAP_LOOKUP, start);
+
+        return reasons & reason;
+}
+
+/* Block host for reason, on top of whatever else it's blocked for. */
+static void block_host(struct context *ctx, unsigned int host, unsigned char reason)
+{
+        unsigned char reasons = 0;
+
+        if (host_allowed(ctx, host)) {
+                return;
+        }
+
+        unsigned long long start = monotonic_ns();
+
+        bpf_map_lookup_elem(ctx->blacklist_fd, &host, &reasons);
+        reasons |= reason;
+        bpf_map_update_elem(ctx->blacklist_fd, &host, &reasons, BPF_ANY);
+        record_time(ctx, TIME_MAP_UPDATE, start);
+}
+
+/* Take back one reason for blocking host, and unblock it if that was the
+ * last one. */
+static void unblock_host(struct context *ctx, unsigned int host, unsigned char reason)
+{
+        unsigned long long start = monotonic_ns();
+        unsigned char reasons;
+
+        if (bpf_map_lookup_elem(ctx->blacklist_fd, &host, &reasons) || !(reasons & reason)) {
+                record_time(ctx, TIME_MAP_LOOKUP, start);
+                return;
+        }
+
+        reasons &= ~reason;
+
+        if (reasons) {
+                bpf_map_update_elem(ctx->blacklist_fd, &host, &reasons, BPF_ANY);
+        } else {
+                bpf_map_delete_elem(ctx->blacklist_fd, &host);
+        }
+
+        record_time(ctx, TIME_MAP_UPDATE, start);
+}
+
+/* Create an empty per-host entry in hash, from pool. */
+static struct element *new_element(apr_hash_t *hash, apr_pool_t *pool, unsigned int host, unsigned int dest)
 {
-        const struct context *ctx2 = ctx;
+        unsigned int *host_addr = (unsigned int *) apr_palloc(pool, sizeof(unsigned int));
+        *host_addr = host;
+
+        struct apr_skiplist *list, *dests;
+        apr_skiplist_init(&list, pool);
+        apr_skiplist_init(&dests, pool);
+
+        struct element *elem = (struct element *) apr_palloc(pool, sizeof(struct element));
+
+        elem->list = list;
+        elem->dests = dests;
+        elem->dest = dest;
+        elem->missed = 0;
+        elem->closed = 0;
+        elem->restored = 0;
+        elem->restored_dests = 0;
+
+        apr_hash_set(hash, host_addr, sizeof(unsigned int), elem);
+
+        return elem;
+}
+
+/* Create an empty per-host entry in the current time period. */
+static struct element *make_element(struct context *ctx, unsigned int host, unsigned int dest)
+{
+        return new_element(ctx->curr, ctx->curr_pool, host, dest);
+}
+
+/* The larger of a restored count and what we've seen since. Ports hit
+ * after a restart are likely the same ones, so the two don't add up. */
+static unsigned int restored_max(unsigned int restored, unsigned int seen)
+{
+        return restored > seen ? restored : seen;
+}
+
+/* Number of distinct ports a host hit in a time period. SYNs that only the
+ * sketch saw, before the host was promoted to exact tracking, are counted as
+ * distinct ports, but no more than carry_over() allows, so this can
+ * overestimate by at most env.sketch_promote - 1. Closed ports count
+ * --closed-weight times. */
+static unsigned int element_count(const struct element *elem)
+{
+        return restored_max(elem->restored, apr_skiplist_size(elem->list)) + elem->missed + elem->closed;
+}
+
+/* Number of distinct destination hosts a host sent SYNs to in a time period,
+ * with the same pre-promotion allowance as element_count(). */
+static unsigned int element_dest_count(const struct element *elem)
+{
+        return restored_max(elem->restored_dests, apr_skiplist_size(elem->dests)) + elem->missed;
+}
+
+static unsigned int prefix_mask(void)
+{
+        return ~0U << (32 - env.prefix_len);
+}
+
+/* Count a SYN from a prefix that sent it to a port under distributed scan. */
+static void count_prefix(struct context *ctx, unsigned int host)
+{
+        unsigned int prefix = host & prefix_mask();
+        unsigned int *count = apr_hash_get(ctx->prefix_curr, &prefix, sizeof(unsigned int));
+
+        if (!count) {
+                if (apr_hash_count(ctx->prefix_curr) >= MAX_PREFIXES) {
+                        return;
+                }
+
+                unsigned int *prefix_key = (unsigned int *) apr_palloc(ctx->curr_pool, sizeof(unsigned int));
+                *prefix_key = prefix;
+
+                count = (unsigned int *) apr_pcalloc(ctx->curr_pool, sizeof(unsigned int));
+                apr_hash_set(ctx->prefix_curr, prefix_key, sizeof(unsigned int), count);
+        }
+
+        (*count)++;
+}
+
+/* Add a SYN to the aggregate for its destination port. This has to happen
+ * for every event, before the sketch decides whether the source is worth
+ * tracking, because a botnet's sources individually never are. */
+static void count_port(struct context *ctx, const struct event *e)
+{
+        if (!env.port_sources) {
+                return;
+        }
+
+        struct port_key key = {
+                .dest = env.per_destination ? e->dest : 0,
+                .port = e->port,
+        };
+
+        struct port_stat *stat = apr_hash_get(ctx->port_curr, &key, sizeof(key));
+
+        if (!stat) {
+                stat = (struct port_stat *) apr_pcalloc(ctx->curr_pool, sizeof(struct port_stat));
+                stat->key = key;
+                apr_hash_set(ctx->port_curr, &stat->key, sizeof(stat->key), stat);
+        }
+
+        stat->syns++;
+        hll_add(&stat->sources, e->host);
+
+        /* A popular service looks swept too, so only SYNs we know aren't
+         * for a listener count against the prefix: probes of a closed port,
+         * or with --listener-aware, anything it let through to us. */
+        if (stat->swept && env.prefix_packets &&
+            ((e->flags & EVENT_CLOSED) || (env.listener_aware && !(e->flags & EVENT_LISTENER)))) {
+                count_prefix(ctx, e->host);
+        }
+}
+
+/* Count one for key in a sketch, and return how far the estimate now stands
+ * above what every key gets from collisions. In a spoofed flood every
+ * counter fills up with other sources' SYNs, and going by the raw estimate
+ * would promote each new source on its first one. */
+static unsigned int sketch_excess(struct sketch *s, unsigned int key)
+{
+        unsigned int estimate = sketch_add(s, key);
+        unsigned int level = sketch_floor(s);
+
+        return estimate > level ? estimate - level : 0;
+}
+
+/* How many of the packets before this one to credit a source with when it's
+ * promoted. Never more than it took to get promoted, whatever the sketch
+ * says: past that, it's as likely to be somebody else's. */
+static unsigned int carry_over(unsigned int excess)
+{
+        if (excess > env.sketch_promote) {
+                excess = env.sketch_promote;
+        }
+
+        return excess ? excess - 1 : 0;
+}
+
+/* Count a UDP packet or ICMP echo request. Sources get a counter once the
+ * flood sketch thinks they've sent enough to matter, same as for SYNs, so a
+ * spoofed flood doesn't cost a counter per source. */
+static void count_flood(struct context *ctx, const struct event *e)
+{
+        struct flood_key key = {
+                .host = e->host,
+                .port = e->port,
+                .proto = e->proto,
+        };
+
+        struct flood_stat *stat = apr_hash_get(ctx->flood_curr, &key, sizeof(key));
+
+        if (!stat) {
+                unsigned int excess = sketch_excess(ctx->flood_sketch, e->host ^ (e->port * 0x9e3779b1U) ^ e->proto);
+
+                if (excess < env.sketch_promote) {
+                        return;
+                }
+
+                stat = (struct flood_stat *) apr_palloc(ctx->curr_pool, sizeof(struct flood_stat));
+                stat->key = key;
+                stat->packets = carry_over(excess);
+                apr_hash_set(ctx->flood_curr, &stat->key, sizeof(stat->key), stat);
+        }
+
+        stat->packets++;
+}
+
+/* Count an outbound SYN from one of our hosts. Same deal as count_flood:
+ * nothing is tracked until the egress sketch thinks it matters, since a
+ * compromised host can spoof its source address as well as anyone. */
+static void count_egress(struct context *ctx, const struct event *e)
+{
+        struct egress_stat *stat = apr_hash_get(ctx->egress_curr, &e->host, sizeof(unsigned int));
+
+        if (!stat) {
+                unsigned int excess = sketch_excess(ctx->egress_sketch, e->host);
+
+                if (excess < env.sketch_promote) {
+                        return;
+                }
+
+                stat = (struct egress_stat *) apr_pcalloc(ctx->curr_pool, sizeof(struct egress_stat));
+                stat->host = e->host;
+                stat->syns = carry_over(excess);
+                apr_hash_set(ctx->egress_curr, &stat->host, sizeof(unsigned int), stat);
+        }
+
+        stat->syns++;
+        hll_add(&stat->dests, e->dest);
+}
+
+/* Bring a decayed counter forward to now. With a time constant of -t, a host
+ * sending new ports at a steady rate settles at about the number it sent in
+ * the last -t seconds, which is what the window estimator approximates too. */
+static double decay_to(struct decay_elem *elem, unsigned long long now)
+{
+        if (now > elem->last) {
+                double age = (double)(now - elem->last) / NSEC_PER_SEC;
+
+                elem->count *= exp(-age / env.time_period);
+                elem->last = now;
+        }
+
+        return elem->count;
+}
+
+/* O(1) per event: decay, then count the port if it isn't one of the last few
+ * this host used. There's no rotation, so there are no ghosts either. */
+static void decay_event(struct context *ctx, const struct event *e, unsigned int missed)
+{
+        struct decay_elem *elem = apr_hash_get(ctx->decay, &e->host, sizeof(unsigned int));
+
+        if (!elem) {
+                elem = calloc(1, sizeof(*elem));
+                if (!elem) {
+                        return;
+                }
+
+                elem->host = e->host;
+                elem->count = missed;
+                elem->last = ctx->now;
+                apr_hash_set(ctx->decay, &elem->host, sizeof(unsigned int), elem);
+        }
+
+        elem->dest = e->dest;
+        decay_to(elem, ctx->now);
+
+        for (int i = 0; i < DECAY_RECENT_PORTS; i++) {
+                if (elem->recent[i] == e->port) {
+                        return;
+                }
+        }
+
+        elem->recent[elem->next] = e->port;
+        elem->next = (elem->next + 1) % DECAY_RECENT_PORTS;
+        elem->count += e->flags & EVENT_CLOSED ? env.closed_weight : 1;
+}
+
+/* The decayed estimator's measure pass: block and unblock like
+ * calculate_rates, and forget hosts that have decayed away. If judge is
+ * false, only do the forgetting. */
+static void decay_sweep(struct context *ctx, bool judge)
+{
+        apr_hash_index_t *hi;
+
+        for (hi = apr_hash_first(NULL, ctx->decay); hi; hi = apr_hash_next(hi)) {
+                const void *key;
+                void *val;
+                struct decay_elem *elem;
+                double rate;
+
+                apr_hash_this(hi, &key, NULL, &val);
+                elem = val;
+                rate = decay_to(elem, ctx->now);
+
+                if (judge) {
+                        bool lost = !host_blocked(ctx, elem->host, BLOCK_SCAN);
+
+                        if (rate > env.num_packets && lost) {
+                                char buff[64] = {0};
+                                time_t now = time(0);
+                                strftime (buff, 64, "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+                                struct in_addr src, dest;
+                                src.s_addr = htonl(elem->host);
+                                dest.s_addr = htonl(elem->dest);
+
+                                dlog(stdout, INFO, "%s: Port scan detected: %s -> ", buff, inet_ntoa(src));
+                                dlog(stdout, INFO, "%s on ~%.1f ports\n", inet_ntoa(dest), rate);
+                                block_host(ctx, elem->host, BLOCK_SCAN);
+                                continue;
+                        }
+
+                        if (rate <= env.num_packets && !lost) {
+                                unblock_host(ctx, elem->host, BLOCK_SCAN);
+                                lost = true;
+                        }
+
+                        if (!lost) {
+                                continue;
+                        }
+                }
+
+                /* Removing the current entry while iterating is safe. */
+                if (rate < DECAY_EPSILON) {
+                        apr_hash_set(ctx->decay, key, sizeof(unsigned int), NULL);
+                        free(elem);
+                }
+        }
+}
+
+static void free_decay(struct context *ctx)
+{
+        apr_hash_index_t *hi;
+
+        for (hi = apr_hash_first(NULL, ctx->decay); hi; hi = apr_hash_next(hi)) {
+                void *val;
+
+                apr_hash_this(hi, NULL, NULL, &val);
+                free(val);
+        }
+
+        apr_hash_clear(ctx->decay);
+}
+
+/* Trace lines are "<seconds> <source> <destination> <port> <flags>
+ * <protocol>", with the time on CLOCK_MONOTONIC. Older traces have no flags
+ * or protocol, and only ever had SYNs. */
+static void record_event(struct context *ctx, const struct event *e)
+{
+        struct in_addr src, dest;
+
+        src.s_addr = htonl(e->host);
+        dest.s_addr = htonl(e->dest);
+
+        fprintf(ctx->record, "%llu.%09llu %s ", ctx->now / NSEC_PER_SEC, ctx->now % NSEC_PER_SEC, inet_ntoa(src));
+        fprintf(ctx->record, "%s %hu %hu %hhu\n", inet_ntoa(dest), e->port, e->flags, e->proto);
+}
+
+static int process_event(void *ctx, void *data, size_t data_sz)
+{
+        struct context *ctx2 = ctx;
         const struct event *e = data;
+        unsigned int excess;
+
+        if (ctx2->record) {
+                record_event(ctx2, e);
+        }
 
-        unsigned int *host_addr = (unsigned int *) apr_palloc(ctx2->curr_pool, sizeof(unsigned int));
-        *host_addr = e->host;
-        unsigned short *port = (unsigned short *) apr_palloc(ctx2->curr_pool, sizeof(unsigned short));
-        *port = e->port;
+        if (e->proto != IPPROTO_TCP) {
+                count_flood(ctx2, e);
+                return 0;
+        }
 
-        /* Add host to "current" hash table. */
-        void *val = apr_hash_get(ctx2->curr, host_addr, sizeof(unsigned int));
+        /* Our own hosts have their own thresholds, and their own tables. */
+        if (e->flags & EVENT_EGRESS) {
+                count_egress(ctx2, e);
+                return 0;
+        }
 
-        struct apr_skiplist *list = (struct apr_skiplist *) apr_palloc(ctx2->curr_pool, sizeof(struct apr_skiplist *));
-        apr_skiplist_init(&list, ctx2->curr_pool);
+        /* A client of one of our services isn't scanning anything, however
+         * often it connects, so it doesn't even go into the sketch. */
+        if (env.listener_aware && (e->flags & EVENT_LISTENER)) {
+                return 0;
+        }
+
+        /* Every SYN that's left goes through the sketch and the
+         * heavy-hitter summary first. Both are fixed size, so a spoofed flood
+         * where every SYN has a new source address costs no memory beyond
+         * this. */
+        excess = sketch_excess(ctx2->sketch, e->host);
+        topk_add(ctx2->topk, e->host);
+
+        count_port(ctx2, e);
+
+        /* One probe of a honeypot port is enough to start watching a host
+         * closely. */
+        bool closed = e->flags & EVENT_CLOSED;
+
+        if (env.estimator == DECAY) {
+                if (excess >= env.sketch_promote || closed || apr_hash_get(ctx2->decay, &e->host, sizeof(unsigned int))) {
+                        decay_event(ctx2, e, carry_over(excess));
+                }
+
+                return 0;
+        }
+
+        struct element *elem = apr_hash_get(ctx2->curr, &e->host, sizeof(unsigned int));
+
+        if (!elem) {
+                /* Only hosts that have sent enough SYNs this time period to
+                 * be likely offenders get full per-host state. */
+                if (excess < env.sketch_promote && !closed) {
+                        return 0;
+                }
+
+                elem = make_element(ctx2, e->host, e->dest);
+                elem->missed = carry_over(excess);
+        }
+
+        /* Don't allocate anything for ports or destinations we've already
+         * seen. */
+        unsigned short port = e->port;
+        unsigned int dest = e->dest;
+        apr_skiplistnode *node;
+
+        if (!apr_skiplist_find_compare(elem->list, &port, &node, (apr_skiplist_compare)port_compare)) {
+                unsigned short *port_key = (unsigned short *) apr_palloc(ctx2->curr_pool, sizeof(unsigned short));
+                *port_key = port;
+
+                apr_skiplist_replace_compare(elem->list, port_key, (apr_skiplist_freefunc)skiplist_free, (apr_skiplist_compare)port_compare);
+
+                if (closed) {
+                        elem->closed += env.closed_weight - 1;
+                }
+        }
+
+        if (!apr_skiplist_find_compare(elem->dests, &dest, &node, (apr_skiplist_compare)skiplist_compare)) {
+                unsigned int *dest_key = (unsigned int *) apr_palloc(ctx2->curr_pool, sizeof(unsigned int));
+                *dest_key = dest;
+
+                apr_skiplist_replace_compare(elem->dests, dest_key, (apr_skiplist_freefunc)skiplist_free, (apr_skiplist_compare)skiplist_compare);
+        }
+
+	return 0;
+}
+
+/* Ring buffer callback. process_event has a lot of ways out, so it's timed
+ * from here. */
+static int handle_event(void *ctx, void *data, size_t data_sz)
+{
+        struct context *ctx2 = ctx;
+        const struct event *e = data;
+        unsigned long long start = monotonic_ns();
+        int ret;
+
+        if (e->ts && e->ts < start) {
+                hist_record(ctx2->event_age, start - e->ts);
+        }
+
+        ret = process_event(ctx, data, data_sz);
+        record_time(ctx2, TIME_HANDLE_EVENT, start);
+
+        return ret;
+}
+
+unsigned int hash_func(const char *key, apr_ssize_t *klen)
+{
+        /* APR expects an unsigned integer hash value. Fortunately, that's
+         * exactly what an IPv4 address is. APR masks off the low bits to pick
+         * a bucket, so mix the whole address into them; otherwise everything
+         * in one /24 lands in the same chain.
+         */
+        unsigned int hash = *(const unsigned int *)key;
+
+        hash ^= hash >> 16;
+        hash *= 0x7feb352d;
+        hash ^= hash >> 15;
+
+        return hash;
+}
+
+int do_hash_print(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        apr_skiplist *list = ((struct element *)value)->list;
+        apr_skiplistnode *node = apr_skiplist_getlist(list);
+
+        if (!node) {
+                return 1;
+        }
+
+        struct in_addr src, dest;
+
+        src.s_addr = htonl(*(unsigned int *)key);
+        dest.s_addr = htonl(((struct element *)value)->dest);
+
+        dlog(stdout, INFO, "%s -> ", inet_ntoa(src));
+        dlog(stdout, INFO, "%s on ports", inet_ntoa(dest));
+
+        void *val;
+        void *next;
+
+        do {
+                val = apr_skiplist_element(node);
+                dlog(stdout, INFO, " %hu", *(unsigned short *)val);
+
+                /* Curiously, apr_skiplist_next doesn't actually use the list
+                 * pointer.
+                 */
+                next = apr_skiplist_next(list, &node);
+        } while(next);
+
+        dlog(stdout, INFO, "\n");
+
+        return 1;
+}
+
+/* Print the distinct destination hosts a host has swept, for horizontal
+ * scans. */
+int do_hash_print_dests(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        apr_skiplist *list = ((struct element *)value)->dests;
+        apr_skiplistnode *node = apr_skiplist_getlist(list);
+
+        if (!node) {
+                return 1;
+        }
+
+        struct in_addr src, dest;
+
+        src.s_addr = htonl(*(unsigned int *)key);
+
+        dlog(stdout, INFO, "%s -> hosts", inet_ntoa(src));
+
+        do {
+                dest.s_addr = htonl(*(unsigned int *)apr_skiplist_element(node));
+                dlog(stdout, INFO, " %s", inet_ntoa(dest));
+        } while (apr_skiplist_next(list, &node));
+
+        dlog(stdout, INFO, "\n");
+
+        return 1;
+}
+
+/* Seconds since the current time period started. */
+static double window_elapsed(const struct context *ctx)
+{
+        if (ctx->now < ctx->period_start) {
+                return 0;
+        }
+
+        return (double)(ctx->now - ctx->period_start) / NSEC_PER_SEC;
+}
+
+/* Fraction of the previous time period that still falls inside the sliding
+ * window. This only depends on when the current period started, not on the
+ * sample timer, so replays can drive it too. */
+static double window_weight(const struct context *ctx)
+{
+        double weight = 1.0 - window_elapsed(ctx) / env.time_period;
+
+        return weight < 0 ? 0 : weight;
+}
+
+static double window_estimate(const struct window_count *count)
+{
+        return count ? hll_estimate(&count->ports) + count->extra : 0;
+}
+
+static void window_merge(struct window_count *count, const struct window_count *other)
+{
+        hll_merge(&count->ports, &other->ports);
+        count->extra += other->extra;
+}
+
+/* Add the ports of a -t period to count. */
+static void window_merge_element(struct window_count *count, const struct element *elem)
+{
+        apr_skiplistnode *node = apr_skiplist_getlist(elem->list);
+
+        if (node) {
+                do {
+                        hll_add(&count->ports, *(unsigned short *)apr_skiplist_element(node));
+                } while (apr_skiplist_next(elem->list, &node));
+        }
+
+        count->extra += element_count(elem) - apr_skiplist_size(elem->list);
+}
+
+/* Sliding window estimate of the number of ports a host hit in each of the
+ * coarser windows. The coarse tables only hold completed periods of the
+ * window below them, so the periods still in progress further down are
+ * merged in. value is the host's entry in the current -t period, if any. */
+static void window_rates(struct context *ctx, const void *key, const struct element *value, double *rates)
+{
+        double elapsed = window_elapsed(ctx);
+        struct window_count pending = {0};
+
+        if (!ctx->num_windows) {
+                return;
+        }
+
+        if (value) {
+                window_merge_element(&pending, value);
+        }
+
+        for (int i = 0; i < ctx->num_windows; i++) {
+                struct window *w = &ctx->windows[i];
+                const struct window_count *curr = apr_hash_get(w->curr, key, sizeof(unsigned int));
+
+                if (curr) {
+                        window_merge(&pending, curr);
+                }
+
+                /* How far into its period this window is: what it holds
+                 * itself, plus what's still in progress below it. */
+                elapsed += w->elapsed;
+                double weight = 1.0 - elapsed / w->period;
+
+                rates[i] = window_estimate(apr_hash_get(w->prev, key, sizeof(unsigned int))) * weight +
+                           window_estimate(&pending);
+        }
+}
+
+/* Decide whether a host should be blocked, across every window. value is the
+ * host's entry in the current time period, or NULL if it only shows up in
+ * the coarser windows. */
+static void judge_host(struct context *ctx, const void *key, const struct element *value)
+{
+        struct element *val;
+        unsigned int prev_count, prev_hosts;
+        unsigned int curr_count, curr_hosts;
+        double weight;
+        double rate, host_rate;
+        double rates[MAX_WINDOWS];
+        int window = -1;
+
+        /* Look up the host in the previous time period, if it exists. */
+        val = apr_hash_get(ctx->prev, key, sizeof(unsigned int));
+        prev_count = 0;
+        prev_hosts = 0;
+
+        if (val) {
+                prev_count = element_count(val);
+                prev_hosts = element_dest_count(val);
+        }
+
+        curr_count = value ? element_count(value) : 0;
+        curr_hosts = value ? element_dest_count(value) : 0;
+
+        /* Vertical (ports) and horizontal (hosts) scans share the same
+         * sliding window. */
+        weight = window_weight(ctx);
+        rate = prev_count * weight + curr_count;
+        host_rate = prev_hosts * weight + curr_hosts;
+
+        /* Slow scans only ever show up in the coarser windows. */
+        window_rates(ctx, key, value, rates);
+        for (int i = 0; i < ctx->num_windows; i++) {
+                if (rates[i] > ctx->windows[i].threshold) {
+                        window = i;
+                        break;
+                }
+        }
+
+        unsigned int host = *(unsigned int *)key;
+
+        /* The XDP program doesn't report trusted sources, but they may have
+         * been counted before they were trusted. */
+        if (host_allowed(ctx, host)) {
+                unblock_host(ctx, host, BLOCK_SCAN);
+                return;
+        }
+
+        bool lost = !host_blocked(ctx, host, BLOCK_SCAN);
+
+        char buff[64] = {0};
+        time_t now = time(0);
+        strftime (buff, 64, "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+        if (rate > env.num_packets && lost && value) {
+                dlog(stdout, INFO, "%s: Port scan detected: ", buff);
+                do_hash_print(ctx, key, sizeof(unsigned int), value);
+                block_host(ctx, host, BLOCK_SCAN);
+                lost = false;
+        }
+
+        if (host_rate > env.num_hosts && lost && value) {
+                dlog(stdout, INFO, "%s: Host scan detected: ", buff);
+                do_hash_print_dests(ctx, key, sizeof(unsigned int), value);
+                block_host(ctx, host, BLOCK_SCAN);
+                lost = false;
+        }
+
+        if (window >= 0 && lost) {
+                struct in_addr src;
+                src.s_addr = htonl(host);
+
+                dlog(stdout, INFO, "%s: Slow port scan detected: %s hit ~%.0f ports in %lds\n",
+                     buff, inet_ntoa(src), rates[window], ctx->windows[window].period);
+                block_host(ctx, host, BLOCK_SCAN);
+        }
+
+        if (rate <= env.num_packets && host_rate <= env.num_hosts && window < 0 && !lost) {
+                unblock_host(ctx, host, BLOCK_SCAN);
+        }
+}
+
+int calculate_rates(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        judge_host((struct context *)rec, key, (const struct element *)value);
+
+        return 1;
+}
+
+/* Hosts that are quiet in the current time period still need judging in the
+ * coarser windows, if only to be unblocked. Hosts that aren't quiet were
+ * already handled by calculate_rates. */
+int calculate_window_rates(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        struct context *ctx = (struct context *)rec;
+
+        if (!apr_hash_get(ctx->curr, key, sizeof(unsigned int))) {
+                judge_host(ctx, key, NULL);
+        }
+
+        return 1;
+}
+
+int calculate_port_rates(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        struct context *ctx = (struct context *)rec;
+        struct port_stat *stat = (struct port_stat *)value;
+        struct port_stat *prev;
+        double weight, sources, syns;
+
+        prev = apr_hash_get(ctx->port_prev, key, sizeof(struct port_key));
+        weight = window_weight(ctx);
+
+        sources = hll_estimate(&stat->sources);
+        syns = stat->syns;
+
+        if (prev) {
+                sources += hll_estimate(&prev->sources) * weight;
+                syns += prev->syns * weight;
+        }
+
+        if (!env.port_sources || sources <= env.port_sources) {
+                stat->swept = false;
+                return 1;
+        }
+
+        if (!stat->swept) {
+                char buff[64] = {0};
+                time_t now = time(0);
+                strftime (buff, 64, "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+                dlog(stdout, INFO, "%s: Distributed scan detected: ", buff);
+
+                if (env.per_destination) {
+                        struct in_addr dest;
+                        dest.s_addr = htonl(stat->key.dest);
+                        dlog(stdout, INFO, "%s ", inet_ntoa(dest));
+                }
+
+                dlog(stdout, INFO, "port %u from ~%.0f sources, %.0f SYNs\n", stat->key.port, sources, syns);
+        }
+
+        stat->swept = true;
+
+        return 1;
+}
+
+int calculate_prefix_rates(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        struct context *ctx = (struct context *)rec;
+        unsigned int *prev;
+        double rate;
+
+        prev = apr_hash_get(ctx->prefix_prev, key, sizeof(unsigned int));
+
+        rate = *(unsigned int *)value;
+        if (prev) {
+                rate += *prev * window_weight(ctx);
+        }
+
+        if (!env.prefix_packets || rate <= env.prefix_packets) {
+                return 1;
+        }
+
+        struct prefix_key pkey = {
+                .prefixlen = env.prefix_len,
+                .addr = htonl(*(unsigned int *)key),
+        };
+        unsigned char reason = PREFIX_DYNAMIC;
+
+        if (!bpf_map_update_elem(ctx->prefix_blacklist_fd, &pkey, &reason, BPF_NOEXIST)) {
+                char buff[64] = {0};
+                time_t now = time(0);
+                strftime (buff, 64, "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+                struct in_addr prefix;
+                prefix.s_addr = pkey.addr;
+
+                dlog(stdout, INFO, "%s: Blocking prefix %s/%u\n", buff, inet_ntoa(prefix), pkey.prefixlen);
+        }
+
+        return 1;
+}
+
+/* Lift prefix blocks once the prefix has calmed down. Unlike hosts, we don't
+ * keep ghost entries for prefixes, so walk the map itself. */
+static void expire_prefixes(struct context *ctx)
+{
+        struct prefix_key key, next;
+        struct prefix_key *cur = NULL;
+        double weight = window_weight(ctx);
+
+        while (!bpf_map_get_next_key(ctx->prefix_blacklist_fd, cur, &next)) {
+                unsigned char reason;
+                unsigned int prefix = ntohl(next.addr);
+                unsigned int *prev, *curr;
+                double rate = 0;
+
+                key = next;
+                cur = &key;
+
+                if (bpf_map_lookup_elem(ctx->prefix_blacklist_fd, &key, &reason) || reason != PREFIX_DYNAMIC) {
+                        continue;
+                }
+
+                prev = apr_hash_get(ctx->prefix_prev, &prefix, sizeof(unsigned int));
+                curr = apr_hash_get(ctx->prefix_curr, &prefix, sizeof(unsigned int));
+
+                if (prev) {
+                        rate += *prev * weight;
+                }
+                if (curr) {
+                        rate += *curr;
+                }
+
+                if (!env.prefix_packets || rate <= env.prefix_packets) {
+                        bpf_map_delete_elem(ctx->prefix_blacklist_fd, &key);
+                }
+        }
+}
+
+/* Block sources over the UDP or ICMP threshold, and unblock the rest. A host
+ * can flood one port and not another, so first find every host that's over
+ * on anything, then act on each host once. */
+static void judge_floods(struct context *ctx)
+{
+        apr_hash_index_t *hi;
+        double weight = window_weight(ctx);
+
+        apr_hash_clear(ctx->flooding);
+
+        for (hi = apr_hash_first(NULL, ctx->flood_curr); hi; hi = apr_hash_next(hi)) {
+                void *val;
+                struct flood_stat *stat, *prev;
+                double rate;
+                long threshold;
+
+                apr_hash_this(hi, NULL, NULL, &val);
+                stat = val;
+
+                prev = apr_hash_get(ctx->flood_prev, &stat->key, sizeof(stat->key));
+                rate = stat->packets + (prev ? prev->packets * weight : 0);
+                threshold = stat->key.proto == IPPROTO_UDP ? env.udp_packets : env.icmp_packets;
+
+                if (threshold && (rate > threshold || stat->adopted || (prev && prev->adopted))) {
+                        apr_hash_set(ctx->flooding, &stat->key.host, sizeof(unsigned int), stat);
+                }
+        }
+
+        for (hi = apr_hash_first(NULL, ctx->flood_curr); hi; hi = apr_hash_next(hi)) {
+                void *val;
+                struct flood_stat *stat, *over;
+
+                apr_hash_this(hi, NULL, NULL, &val);
+                stat = val;
+                over = apr_hash_get(ctx->flooding, &stat->key.host, sizeof(unsigned int));
+
+                if (!over) {
+                        unblock_host(ctx, stat->key.host, BLOCK_FLOOD);
+                        continue;
+                }
+
+                if (over != stat || host_blocked(ctx, stat->key.host, BLOCK_FLOOD)) {
+                        continue;
+                }
+
+                char buff[64] = {0};
+                time_t now = time(0);
+                strftime (buff, 64, "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+                struct in_addr src;
+                src.s_addr = htonl(stat->key.host);
+
+                if (stat->key.proto == IPPROTO_UDP) {
+                        dlog(stdout, INFO, "%s: UDP flood detected: %s -> port %hu\n", buff, inet_ntoa(src), stat->key.port);
+                } else {
+                        dlog(stdout, INFO, "%s: ICMP flood detected: %s\n", buff, inet_ntoa(src));
+                }
+
+                block_host(ctx, stat->key.host, BLOCK_FLOOD);
+        }
+}
+
+/* Stop our own hosts that went over an egress threshold from opening new
+ * connections, and let the rest go again. These are our hosts, so the
+ * allowlist doesn't apply; a trusted host is exactly what an attacker would
+ * want to scan from. */
+static void judge_egress(struct context *ctx)
+{
+        apr_hash_index_t *hi;
+        double weight = window_weight(ctx);
+        unsigned char one = 1;
+
+        for (hi = apr_hash_first(NULL, ctx->egress_curr); hi; hi = apr_hash_next(hi)) {
+                void *val;
+                struct egress_stat *stat, *prev;
+                double syns, dests;
+
+                apr_hash_this(hi, NULL, NULL, &val);
+                stat = val;
+
+                prev = apr_hash_get(ctx->egress_prev, &stat->host, sizeof(unsigned int));
+                syns = stat->syns + (prev ? prev->syns * weight : 0);
+                dests = hll_estimate(&stat->dests) + (prev ? hll_estimate(&prev->dests) * weight : 0);
+
+                bool over = (env.egress_packets && syns > env.egress_packets) ||
+                            (env.egress_hosts && dests > env.egress_hosts) ||
+                            ((env.egress_packets || env.egress_hosts) && (stat->adopted || (prev && prev->adopted)));
+
+                if (!over) {
+                        if (stat->blocked || (prev && prev->blocked)) {
+                                bpf_map_delete_elem(ctx->egress_blacklist_fd, &stat->host);
+                        }
+                        stat->blocked = false;
+                        continue;
+                }
+
+                if (!stat->blocked && !(prev && prev->blocked)) {
+                        char buff[64] = {0};
+                        time_t now = time(0);
+                        strftime (buff, 64, "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+                        struct in_addr src;
+                        src.s_addr = htonl(stat->host);
+
+                        dlog(stdout, INFO, "%s: Outbound scan detected: %s sent %.0f SYNs to about %.0f hosts\n",
+                             buff, inet_ntoa(src), syns, dests);
+
+                        bpf_map_update_elem(ctx->egress_blacklist_fd, &stat->host, &one, BPF_ANY);
+                }
+
+                stat->blocked = true;
+        }
+}
+
+int make_ghost(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        struct context *ctx = (struct context *)rec;
+        struct element *old_elem = (struct element *)value;
+
+        /* If the prev list has a nonzero length (i.e. we received requests),
+         * create a ghost entry of size 0 so rate calculations work properly.
+         */
+        if (element_count(old_elem) > 0) {
+                make_element(ctx, *(unsigned int *)key, old_elem->dest);
+        }
+
+        return 1;
+}
+
+/* Ghost flood counters, for the same reason as make_ghost: a blocked source
+ * sends us nothing, and still needs judging to be unblocked. */
+int make_flood_ghost(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        struct context *ctx = (struct context *)rec;
+        const struct flood_stat *old_stat = value;
+
+        if (old_stat->packets > 0 || old_stat->adopted) {
+                struct flood_stat *stat = (struct flood_stat *) apr_palloc(ctx->curr_pool, sizeof(struct flood_stat));
+
+                stat->key = old_stat->key;
+                stat->packets = 0;
+                apr_hash_set(ctx->flood_curr, &stat->key, sizeof(stat->key), stat);
+        }
+
+        return 1;
+}
+
+/* Ghost egress counters. A blocked host's SYNs never make it out to be
+ * counted, so without these it would never be judged again. */
+int make_egress_ghost(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        struct context *ctx = (struct context *)rec;
+        const struct egress_stat *old_stat = value;
+
+        if (old_stat->syns > 0 || old_stat->blocked) {
+                struct egress_stat *stat = (struct egress_stat *) apr_pcalloc(ctx->curr_pool, sizeof(struct egress_stat));
+
+                stat->host = old_stat->host;
+                stat->blocked = old_stat->blocked;
+                apr_hash_set(ctx->egress_curr, &stat->host, sizeof(unsigned int), stat);
+        }
+
+        return 1;
+}
+
+/* Debug output for the heaviest SYN senders of the time period that just
+ * ended, whether or not they were promoted to exact tracking. */
+static void print_top_talkers(const struct topk *topk)
+{
+        struct topk_entry entries[TOPK_SIZE];
+        unsigned int n = topk_sorted(topk, entries);
+
+        for (unsigned int i = 0; i < n; i++) {
+                struct in_addr src;
+                src.s_addr = htonl(entries[i].key);
+
+                dlog(stdout, DEBUG, "Top talker: %s sent %u SYNs (+/- %u)\n",
+                     inet_ntoa(src), entries[i].count, entries[i].error);
+        }
+}
+
+static struct window_count *window_get(struct window *w, const void *key)
+{
+        struct window_count *curr = apr_hash_get(w->curr, key, sizeof(unsigned int));
+
+        if (!curr) {
+                unsigned int *host_addr = (unsigned int *) apr_palloc(w->curr_pool, sizeof(unsigned int));
+                *host_addr = *(const unsigned int *)key;
+
+                curr = (struct window_count *) apr_pcalloc(w->curr_pool, sizeof(struct window_count));
+                apr_hash_set(w->curr, host_addr, sizeof(unsigned int), curr);
+        }
+
+        return curr;
+}
+
+/* Roll a completed period of -t up into the first window. */
+int roll_up_element(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        const struct element *elem = value;
+
+        if (element_count(elem) > 0) {
+                window_merge_element(window_get((struct window *)rec, key), elem);
+        }
+
+        return 1;
+}
+
+/* Roll a completed period of one window up into the next. */
+int roll_up_count(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        if (window_estimate(value) > 0) {
+                window_merge(window_get((struct window *)rec, key), value);
+        }
+
+        return 1;
+}
+
+/* Same idea as make_ghost: a host that was active last period needs an entry
+ * this period so calculate_window_rates gets to look at it. */
+int make_window_ghost(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+        if (window_estimate(value) > 0) {
+                window_get((struct window *)rec, key);
+        }
+
+        return 1;
+}
+
+static void rotate_window(struct window *w)
+{
+        apr_hash_t *temp;
+        apr_pool_t *temp_pool;
+
+        temp = w->prev;
+        w->prev = w->curr;
+        w->curr = temp;
+        apr_hash_clear(w->curr);
+
+        apr_pool_clear(w->prev_pool);
+        temp_pool = w->prev_pool;
+        w->prev_pool = w->curr_pool;
+        w->curr_pool = temp_pool;
+
+        w->elapsed = 0;
+
+        apr_hash_do((apr_hash_do_callback_fn_t *)make_window_ghost, (void *)w, w->prev);
+}
+
+/* Called once ctx->prev holds a freshly completed period of -t. Each window
+ * that completes a period as a result hands it up to the next before
+ * rotating. */
+static void cascade_windows(struct context *ctx)
+{
+        long completed = env.time_period;
+
+        if (!ctx->num_windows) {
+                return;
+        }
+
+        apr_hash_do((apr_hash_do_callback_fn_t *)roll_up_element, (void *)&ctx->windows[0], ctx->prev);
+
+        for (int i = 0; i < ctx->num_windows; i++) {
+                struct window *w = &ctx->windows[i];
+
+                w->elapsed += completed;
+                if (w->elapsed < w->period) {
+                        break;
+                }
+
+                if (i + 1 < ctx->num_windows) {
+                        apr_hash_do((apr_hash_do_callback_fn_t *)roll_up_count, (void *)&ctx->windows[i + 1], w->curr);
+                }
+
+                rotate_window(w);
+                completed = w->period;
+        }
+}
+
+int swap_hash(struct context *ctx)
+{
+        apr_hash_t *temp;
+        apr_pool_t *temp_pool;
+
+        /* Swap hash tables. */
+        temp = ctx->prev;
+        ctx->prev = ctx->curr;
+        ctx->curr = temp;
+
+        /* Clear the current hash table. */
+        apr_hash_clear(ctx->curr);
+
+        /* The period that just ended is complete, so it can be handed up to
+         * the coarser windows. */
+        cascade_windows(ctx);
+
+        /* Same for the per-port and per-prefix aggregates. */
+        temp = ctx->port_prev;
+        ctx->port_prev = ctx->port_curr;
+        ctx->port_curr = temp;
+        apr_hash_clear(ctx->port_curr);
+
+        temp = ctx->prefix_prev;
+        ctx->prefix_prev = ctx->prefix_curr;
+        ctx->prefix_curr = temp;
+        apr_hash_clear(ctx->prefix_curr);
+
+        temp = ctx->flood_prev;
+        ctx->flood_prev = ctx->flood_curr;
+        ctx->flood_curr = temp;
+        apr_hash_clear(ctx->flood_curr);
+        sketch_clear(ctx->flood_sketch);
+
+        temp = ctx->egress_prev;
+        ctx->egress_prev = ctx->egress_curr;
+        ctx->egress_curr = temp;
+        apr_hash_clear(ctx->egress_curr);
+        sketch_clear(ctx->egress_sketch);
+
+        /* Start counting the new time period from scratch. */
+        print_top_talkers(ctx->topk);
+        sketch_clear(ctx->sketch);
+        topk_clear(ctx->topk);
+
+        ctx->period_start = ctx->now;
+
+        /* Swap pools. */
+        apr_pool_clear(ctx->prev_pool);
+
+        temp_pool = ctx->prev_pool;
+        ctx->prev_pool = ctx->curr_pool;
+        ctx->curr_pool = temp_pool;
+
+        /* Create "ghost" entries for rate calculation.
+         * We copy everything non-zero from prev back
+         * into curr and set it to zero.
+         */
+        apr_hash_do((apr_hash_do_callback_fn_t *)make_ghost, (void *)ctx, ctx->prev);
+        apr_hash_do((apr_hash_do_callback_fn_t *)make_flood_ghost, (void *)ctx, ctx->flood_prev);
+        apr_hash_do((apr_hash_do_callback_fn_t *)make_egress_ghost, (void *)ctx, ctx->egress_prev);
+
+        return 1;
+}
+
+/* The snapshot file is this header, then num_prev entries for the previous
+ * time period and num_curr for the current one. Counts only; the ports and
+ * destinations themselves aren't worth the space. */
+struct snapshot_header {
+        unsigned int magic;
+        unsigned int version;
+        /* CLOCK_REALTIME when it was written. */
+        unsigned long long written;
+        /* How far into the current time period we were, in nanoseconds. */
+        unsigned long long elapsed;
+        long time_period;
+        unsigned int num_prev;
+        unsigned int num_curr;
+};
+
+struct snapshot_entry {
+        unsigned int host;
+        unsigned int dest;
+        unsigned int ports;
+        unsigned int dests;
+};
+
+static struct snapshot_entry *snapshot_table(apr_hash_t *hash, struct snapshot_entry *out)
+{
+        apr_hash_index_t *hi;
+
+        for (hi = apr_hash_first(NULL, hash); hi; hi = apr_hash_next(hi)) {
+                const void *key;
+                void *val;
+                const struct element *elem;
+
+                apr_hash_this(hi, &key, NULL, &val);
+                elem = val;
+
+                out->host = *(const unsigned int *)key;
+                out->dest = elem->dest;
+                out->ports = element_count(elem);
+                out->dests = element_dest_count(elem);
+                out++;
+        }
+
+        return out;
+}
+
+/* Write the per-host window state to path. It goes to a temporary file
+ * first, mapped and filled in one go, and is renamed over path when it's
+ * complete, so a crash halfway leaves the last good snapshot alone. */
+static int save_snapshot(struct context *ctx, const char *path)
+{
+        char tmp[PATH_MAX];
+        unsigned int num_prev = apr_hash_count(ctx->prev);
+        unsigned int num_curr = apr_hash_count(ctx->curr);
+        size_t size = sizeof(struct snapshot_header) + (size_t)(num_prev + num_curr) * sizeof(struct snapshot_entry);
+        struct snapshot_header *header;
+        int fd;
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+        fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+                dlog(stderr, INFO, "Failed to write %s: %s\n", tmp, strerror(errno));
+                return -1;
+        }
+
+        if (ftruncate(fd, size)) {
+                dlog(stderr, INFO, "Failed to write %s: %s\n", tmp, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (header == MAP_FAILED) {
+                dlog(stderr, INFO, "Failed to map %s: %s\n", tmp, strerror(errno));
+                return -1;
+        }
+
+        header->magic = SNAPSHOT_MAGIC;
+        header->version = SNAPSHOT_VERSION;
+        header->written = realtime_ns();
+        header->elapsed = ctx->now - ctx->period_start;
+        header->time_period = env.time_period;
+        header->num_prev = num_prev;
+        header->num_curr = num_curr;
+
+        struct snapshot_entry *entries = (struct snapshot_entry *)(header + 1);
+
+        snapshot_table(ctx->curr, snapshot_table(ctx->prev, entries));
+
+        munmap(header, size);
+
+        if (rename(tmp, path)) {
+                dlog(stderr, INFO, "Failed to write %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+static void restore_table(apr_hash_t *hash, apr_pool_t *pool, const struct snapshot_entry *entries, unsigned int n)
+{
+        for (unsigned int i = 0; i < n; i++) {
+                struct element *elem = new_element(hash, pool, entries[i].host, entries[i].dest);
+
+                elem->restored = entries[i].ports;
+                elem->restored_dests = entries[i].dests;
+        }
+}
+
+/* Pick up where the last run left off, if its snapshot is recent enough to
+ * matter. Returns how far into the current time period we are, which the
+ * caller has to start the period timer from. If the snapshot's current period
+ * has ended since, it becomes our previous one, same as in swap_hash. */
+static unsigned long long load_snapshot(struct context *ctx, const char *path)
+{
+        unsigned long long start = monotonic_ns();
+        unsigned long long period = env.time_period * NSEC_PER_SEC;
+        struct snapshot_header *header;
+        struct stat st;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                if (errno != ENOENT) {
+                        dlog(stderr, INFO, "Failed to read %s: %s\n", path, strerror(errno));
+                }
+                return 0;
+        }
+
+        if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*header)) {
+                close(fd);
+                return 0;
+        }
+
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (header == MAP_FAILED) {
+                dlog(stderr, INFO, "Failed to map %s: %s\n", path, strerror(errno));
+                return 0;
+        }
+
+        unsigned long long now = realtime_ns();
+        unsigned long long offset = header->elapsed + (now > header->written ? now - header->written : 0);
+        const struct snapshot_entry *entries = (const struct snapshot_entry *)(header + 1);
+        size_t expected = sizeof(*header) + ((size_t)header->num_prev + header->num_curr) * sizeof(*entries);
+
+        if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION || (size_t)st.st_size != expected) {
+                dlog(stderr, INFO, "Ignoring %s, it isn't a snapshot\n", path);
+                offset = 0;
+        } else if (header->time_period != env.time_period) {
+                dlog(stderr, INFO, "Ignoring %s, it was taken with a different -t\n", path);
+                offset = 0;
+        } else if (offset >= 2 * period) {
+                dlog(stdout, DEBUG, "Ignoring %s, it's too old to matter\n", path);
+                offset = 0;
+        } else if (offset >= period) {
+                restore_table(ctx->prev, ctx->prev_pool, entries + header->num_prev, header->num_curr);
+                apr_hash_do((apr_hash_do_callback_fn_t *)make_ghost, (void *)ctx, ctx->prev);
+                offset -= period;
+        } else {
+                restore_table(ctx->prev, ctx->prev_pool, entries, header->num_prev);
+                restore_table(ctx->curr, ctx->curr_pool, entries + header->num_prev, header->num_curr);
+        }
+
+        if (offset) {
+                dlog(stdout, INFO, "Restored %u hosts from %s in %llu us\n",
+                     apr_hash_count(ctx->prev) + apr_hash_count(ctx->curr), path, (monotonic_ns() - start) / 1000);
+        }
+
+        munmap(header, st.st_size);
+
+        return offset;
+}
+
+/* Take over the blocks a previous run left in pinned maps. We don't know
+ * what the hosts sent, only that it was too much. Scanners are counted as
+ * just over -n in the current time period. Floods and outbound scans can be
+ * over either of two thresholds, so they're marked adopted instead and held
+ * until the end of the next period. Nothing they send gets through to be
+ * counted, so they're let go a period or so from now, same as if we'd never
+ * restarted. */
+static void adopt_blocks(struct context *ctx)
+{
+        unsigned int key, next;
+        unsigned int *cur = NULL;
+        unsigned int adopted = 0;
+
+        while (!bpf_map_get_next_key(ctx->blacklist_fd, cur, &next)) {
+                unsigned char reasons;
+
+                key = next;
+                cur = &key;
+
+                if (bpf_map_lookup_elem(ctx->blacklist_fd, &key, &reasons)) {
+                        continue;
+                }
+
+                /* A snapshot knows better than we do. */
+                if ((reasons & BLOCK_SCAN) && !apr_hash_get(ctx->curr, &key, sizeof(unsigned int)) &&
+                    !apr_hash_get(ctx->prev, &key, sizeof(unsigned int))) {
+                        struct element *elem = make_element(ctx, key, 0);
+
+                        elem->missed = env.num_packets + 1;
+                }
+
+                if (reasons & BLOCK_FLOOD) {
+                        struct flood_stat *stat = (struct flood_stat *) apr_pcalloc(ctx->curr_pool, sizeof(struct flood_stat));
+
+                        stat->key.host = key;
+                        stat->key.proto = env.udp_packets ? IPPROTO_UDP : IPPROTO_ICMP;
+                        stat->adopted = true;
+                        apr_hash_set(ctx->flood_curr, &stat->key, sizeof(stat->key), stat);
+                }
+
+                adopted++;
+        }
+
+        cur = NULL;
+        while (!bpf_map_get_next_key(ctx->egress_blacklist_fd, cur, &next)) {
+                struct egress_stat *stat = (struct egress_stat *) apr_pcalloc(ctx->curr_pool, sizeof(struct egress_stat));
+
+                key = next;
+                cur = &key;
+
+                stat->host = key;
+                stat->blocked = true;
+                stat->adopted = true;
+                apr_hash_set(ctx->egress_curr, &stat->host, sizeof(unsigned int), stat);
+                adopted++;
+        }
+
+        struct prefix_key pkey, pnext;
+        struct prefix_key *pcur = NULL;
+
+        while (!bpf_map_get_next_key(ctx->prefix_blacklist_fd, pcur, &pnext)) {
+                unsigned int *prefix = (unsigned int *) apr_palloc(ctx->curr_pool, sizeof(unsigned int));
+                unsigned int *count = (unsigned int *) apr_palloc(ctx->curr_pool, sizeof(unsigned int));
+
+                pkey = pnext;
+                pcur = &pkey;
+
+                *prefix = ntohl(pkey.addr);
+                *count = env.prefix_packets + 1;
+                apr_hash_set(ctx->prefix_curr, prefix, sizeof(unsigned int), count);
+                adopted++;
+        }
+
+        dlog(stdout, INFO, "Picked up %u blocks from %s\n", adopted, env.pin_path);
+}
+
+/* Set up the hash tables, pools and sketches. Everything but the BPF side
+ * of the context. */
+static int init_context(struct context *ctx, apr_pool_t *pool)
+{
+        /* We create two separate pools for the previous and current hash tables
+         * This lets us properly free the memory used by individual hash elements. 
+         */
+        apr_pool_create(&(ctx->prev_pool), pool);
+        apr_pool_create(&(ctx->curr_pool), pool);
+
+        /* Create our hash tables. prev is for the previous time period, and
+         * curr is for the current time period. When we pass a time boundary, we
+         * free prev, set prev to curr, and set curr to a new hash table.
+         */
+        apr_hashfunc_t hash_func_cb = hash_func;
+
+        /* We allocate the hash tables themselves from the parent pool. */
+        ctx->prev = apr_hash_make_custom(pool, hash_func_cb);
+        ctx->curr = apr_hash_make_custom(pool, hash_func_cb);
+        ctx->port_prev = apr_hash_make(pool);
+        ctx->port_curr = apr_hash_make(pool);
+        ctx->prefix_prev = apr_hash_make_custom(pool, hash_func_cb);
+        ctx->prefix_curr = apr_hash_make_custom(pool, hash_func_cb);
+        /* hash_func only looks at the first four bytes, which for a flood
+         * key is just the host, so every port it floods would collide. */
+        ctx->flood_prev = apr_hash_make(pool);
+        ctx->flood_curr = apr_hash_make(pool);
+        ctx->flooding = apr_hash_make_custom(pool, hash_func_cb);
+        ctx->egress_prev = apr_hash_make_custom(pool, hash_func_cb);
+        ctx->egress_curr = apr_hash_make_custom(pool, hash_func_cb);
+
+        /* Decayed counters are never rotated. Their entries are malloc()ed
+         * and freed one by one as they decay away. */
+        ctx->decay = apr_hash_make_custom(pool, hash_func_cb);
+
+        /* The sketch and heavy-hitter summary sit in front of the hash
+         * tables and never grow, so they live outside the pools. */
+        ctx->sketch = apr_palloc(pool, sizeof(*ctx->sketch));
+        ctx->flood_sketch = apr_palloc(pool, sizeof(*ctx->flood_sketch));
+        ctx->egress_sketch = apr_palloc(pool, sizeof(*ctx->egress_sketch));
+        ctx->topk = apr_palloc(pool, sizeof(*ctx->topk));
+        if (!ctx->sketch || !ctx->flood_sketch || !ctx->egress_sketch || !ctx->topk) {
+                dlog(stderr, INFO, "Failed to allocate sketch\n");
+                return -1;
+        }
+
+        sketch_init(ctx->sketch, (unsigned int)time(NULL) ^ (unsigned int)getpid());
+        sketch_init(ctx->flood_sketch, ctx->sketch->seeds[SKETCH_DEPTH - 1]);
+        sketch_init(ctx->egress_sketch, ctx->flood_sketch->seeds[SKETCH_DEPTH - 1]);
+        topk_clear(ctx->topk);
+
+        ctx->timings = apr_pcalloc(pool, TIME_MAX * sizeof(*ctx->timings));
+        ctx->event_age = apr_pcalloc(pool, sizeof(*ctx->event_age));
+
+        /* The coarser windows get the same pair-of-pools treatment as the
+         * main hash tables. */
+        ctx->num_windows = env.num_windows;
+        for (int i = 0; i < ctx->num_windows; i++) {
+                struct window *w = &ctx->windows[i];
+
+                w->period = env.windows[i].period;
+                w->threshold = env.windows[i].threshold;
+                w->elapsed = 0;
+                apr_pool_create(&w->prev_pool, pool);
+                apr_pool_create(&w->curr_pool, pool);
+                w->prev = apr_hash_make_custom(pool, hash_func_cb);
+                w->curr = apr_hash_make_custom(pool, hash_func_cb);
+        }
+
+        ctx->now = monotonic_ns();
+        ctx->period_start = ctx->now;
+        ctx->record = NULL;
+        ctx->ring_consumer = NULL;
+        ctx->ring_producer = NULL;
+        ctx->ring_size = 0;
+        ctx->ring_backlog_max = 0;
+        ctx->last_lost = 0;
+
+        return 0;
+}
+
+/* Turn SYNs per second and a burst size into GCRA parameters. A burst
+ * tolerance of (burst - 1) intervals lets burst SYNs through back to back. */
+static struct rate_limit make_rate(double pps, long burst)
+{
+        struct rate_limit limit = { 0 };
+
+        if (pps > 0) {
+                limit.interval = NSEC_PER_SEC / pps;
+                limit.burst = (burst - 1) * limit.interval;
+        }
+
+        return limit;
+}
+
+/* Set the SYN rate for a source address or prefix. This is the only thing
+ * userspace has to do for rate limiting; the XDP program does the rest. */
+static int set_rate(struct context *ctx, unsigned int addr, unsigned int prefixlen, const struct rate_limit *limit)
+{
+        if (prefixlen == 32) {
+                return bpf_map_update_elem(ctx->host_rates_fd, &addr, limit, BPF_ANY);
+        }
+
+        struct prefix_key pkey = {
+                .prefixlen = prefixlen,
+                .addr = htonl(addr),
+        };
+
+        return bpf_map_update_elem(ctx->prefix_rates_fd, &pkey, limit, BPF_ANY);
+}
+
+/* Take a source's own SYN rate away again, so it gets the default. */
+static void clear_rate(struct context *ctx, unsigned int addr, unsigned int prefixlen)
+{
+        if (prefixlen == 32) {
+                bpf_map_delete_elem(ctx->host_rates_fd, &addr);
+                return;
+        }
+
+        struct prefix_key pkey = {
+                .prefixlen = prefixlen,
+                .addr = htonl(addr),
+        };
+
+        bpf_map_delete_elem(ctx->prefix_rates_fd, &pkey);
+}
+
+static int write_settings(struct context *ctx)
+{
+        unsigned int zero = 0;
+        struct settings settings = {
+                .syn_rate = make_rate(env.syn_rate, env.syn_burst),
+                .syncookies = ctx->syncookies,
+                .port_filter = env.port_filter,
+                .listener_aware = env.listener_aware,
+                .udp_floods = env.udp_packets > 0,
+                .icmp_floods = env.icmp_packets > 0,
+                .threat_queue = ctx->threat_queue,
+        };
+
+        if (bpf_map_update_elem(ctx->settings_fd, &zero, &settings, BPF_ANY)) {
+                dlog(stderr, INFO, "Failed to update settings: %s\n", strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Push everything the XDP program needs to know from env into its maps. On
+ * a reload, old is what was there before, so that only what changed is
+ * written and anything dropped from the configuration is taken out. */
+static int apply_settings(struct context *ctx, const struct env *old)
+{
+        if (write_settings(ctx)) {
+                return -1;
+        }
+
+        for (unsigned int i = 0; i < PORT_POLICY_ENTRIES; i++) {
+                bool set = env.ports[i].protect || env.ports[i].closed;
+
+                if (old ? !memcmp(&old->ports[i], &env.ports[i], sizeof(env.ports[i])) : !set) {
+                        continue;
+                }
+
+                if (bpf_map_update_elem(ctx->port_policy_fd, &i, &env.ports[i], BPF_ANY)) {
+                        dlog(stderr, INFO, "Failed to set port policy: %s\n", strerror(errno));
+                        return -1;
+                }
+        }
+
+        /* The whole flags table is 256 bytes, so just write all of it. */
+        for (unsigned int flags = 0; flags < 256; flags++) {
+                unsigned char pattern = flag_pattern(flags);
+
+                if (!env.drop_flags[pattern]) {
+                        pattern = PATTERN_OK;
+                }
+
+                if (bpf_map_update_elem(ctx->flag_policy_fd, &flags, &pattern, BPF_ANY)) {
+                        dlog(stderr, INFO, "Failed to set flag policy: %s\n", strerror(errno));
+                        return -1;
+                }
+        }
+
+        for (int i = 0; old && i < old->num_rates; i++) {
+                const struct rate_rule *rule = &old->rates[i];
+                bool kept = false;
+
+                for (int j = 0; j < env.num_rates; j++) {
+                        kept |= env.rates[j].addr == rule->addr && env.rates[j].prefixlen == rule->prefixlen;
+                }
+
+                if (!kept) {
+                        clear_rate(ctx, rule->addr, rule->prefixlen);
+                }
+        }
+
+        for (int i = 0; i < env.num_rates; i++) {
+                struct rate_rule *rule = &env.rates[i];
+                struct rate_limit limit = make_rate(rule->pps, rule->burst ? rule->burst : env.syn_burst);
+
+                if (set_rate(ctx, rule->addr, rule->prefixlen, &limit)) {
+                        dlog(stderr, INFO, "Failed to set rate: %s\n", strerror(errno));
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/* Re-read --config, on SIGHUP. Counts, blocks and the attached programs are
+ * all left alone; only thresholds, the time period and the policy maps
+ * change. If the file is no good, nothing does. */
+static int reload_config(struct context *ctx, int sample_fd)
+{
+        struct env old = env;
+
+        if (!env.config) {
+                dlog(stdout, INFO, "Got SIGHUP, but there's no --config to reload\n");
+                return 0;
+        }
+
+        reset_reloadable(&cmdline);
+
+        if (read_config(env.config, true) || check_windows()) {
+                dlog(stderr, INFO, "Keeping the old configuration\n");
+                env = old;
+                return -1;
+        }
+
+        if (apply_settings(ctx, &old)) {
+                return -1;
+        }
+
+        /* The current period carries on, and ends when the new -t says it
+         * should, or straight away if that's already passed. The sliding
+         * window weights follow env.time_period by themselves. */
+        if (env.time_period != old.time_period) {
+                unsigned long long period = env.time_period * NSEC_PER_SEC;
+                unsigned long long elapsed = ctx->now - ctx->period_start;
+                unsigned long long left = elapsed < period ? period - elapsed : 1;
+                struct itimerspec its = {
+                        .it_interval = { .tv_sec = env.time_period },
+                        .it_value = { .tv_sec = left / NSEC_PER_SEC, .tv_nsec = left % NSEC_PER_SEC },
+                };
+
+                timerfd_settime(sample_fd, 0, &its, NULL);
+
+                /* The first coarser window is fed whole periods of -t, so
+                 * what it's seen so far has to be a multiple of the new one,
+                 * or it would never line up with its own period again. The
+                 * rest are fed by windows that haven't changed. */
+                if (ctx->num_windows) {
+                        ctx->windows[0].elapsed -= ctx->windows[0].elapsed % env.time_period;
+                }
+        }
+
+        dlog(stdout, INFO, "Reloaded %s\n", env.config);
+
+        return 0;
+}
+
+/* Sum one entry of a per-CPU counter array across CPUs. */
+static unsigned long long read_percpu(int fd, unsigned int key)
+{
+        int ncpus = libbpf_num_possible_cpus();
+        unsigned long long total = 0;
+
+        if (ncpus <= 0) {
+                return 0;
+        }
+
+        unsigned long long values[ncpus];
+
+        if (bpf_map_lookup_elem(fd, &key, values)) {
+                return 0;
+        }
+
+        for (int i = 0; i < ncpus; i++) {
+                total += values[i];
+        }
+
+        return total;
+}
+
+/* Sum a data-plane counter across CPUs. */
+static unsigned long long read_stat(struct context *ctx, unsigned int stat)
+{
+        return read_percpu(ctx->stats_fd, stat);
+}
+
+/* Load the allowlist: one address or CIDR prefix per line, with # comments
+ * and blank lines ignored. */
+static int load_allowlist(struct context *ctx, const char *path)
+{
+        FILE *f = fopen(path, "r");
+        char line[256];
+        int lineno = 0, count = 0;
+
+        if (!f) {
+                dlog(stderr, INFO, "Failed to open %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                char *start = line, *end;
+                unsigned char allowed = 1;
+                struct prefix_key pkey;
+                unsigned int addr;
+
+                lineno++;
+
+                end = strchr(start, '#');
+                if (end) {
+                        *end = '\0';
+                }
+
+                start += strspn(start, " \t");
+                end = start + strcspn(start, " \t\r\n");
+                *end = '\0';
+
+                if (!*start) {
+                        continue;
+                }
+
+                if (parse_cidr(start, &addr, &pkey.prefixlen)) {
+                        dlog(stderr, INFO, "%s:%d: Invalid address: %s\n", path, lineno, start);
+                        fclose(f);
+                        return -1;
+                }
+
+                pkey.addr = htonl(addr);
+
+                if (bpf_map_update_elem(ctx->allowlist_fd, &pkey, &allowed, BPF_ANY)) {
+                        dlog(stderr, INFO, "Failed to update allowlist: %s\n", strerror(errno));
+                        fclose(f);
+                        return -1;
+                }
+
+                count++;
+        }
+
+        fclose(f);
+        dlog(stdout, DEBUG, "Loaded %d allowlist entries from %s\n", count, path);
+
+        return 0;
+}
+
+/* Parse a dotted quad at the start of str, in host byte order. Threat feeds
+ * run to millions of lines, and this is a lot quicker than inet_pton. */
+static const char *parse_ipv4(const char *str, unsigned int *addr)
+{
+        unsigned int result = 0;
+
+        for (int i = 0; i < 4; i++) {
+                unsigned int octet = 0;
+                int digits = 0;
+
+                if (i && *str++ != '.') {
+                        return NULL;
+                }
+
+                while (*str >= '0' && *str <= '9' && digits < 3) {
+                        octet = octet * 10 + (*str++ - '0');
+                        digits++;
+                }
+
+                if (!digits || octet > 255) {
+                        return NULL;
+                }
+
+                result = result << 8 | octet;
+        }
+
+        *addr = result;
+
+        return str;
+}
+
+/* Read a threat feed: one address per line, with # comments and blank lines
+ * ignored. Returns a malloc()ed array of addresses in host byte order. */
+static unsigned int *read_threats(const char *path, size_t *count)
+{
+        FILE *f = fopen(path, "r");
+        unsigned int *addrs = NULL;
+        size_t size = 0;
+        char line[256];
+        int lineno = 0;
+
+        *count = 0;
+
+        if (!f) {
+                dlog(stderr, INFO, "Failed to open %s: %s\n", path, strerror(errno));
+                return NULL;
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                const char *p = line + strspn(line, " \t");
+                unsigned int addr;
+
+                lineno++;
+
+                if (*p == '#' || *p == '\n' || *p == '\r' || !*p) {
+                        continue;
+                }
+
+                p = parse_ipv4(p, &addr);
+                if (!p || !strchr(" \t\r\n#", *p)) {
+                        dlog(stderr, INFO, "%s:%d: Invalid address\n", path, lineno);
+                        free(addrs);
+                        fclose(f);
+                        return NULL;
+                }
+
+                if (*count == size) {
+                        size = size ? size * 2 : 65536;
+                        unsigned int *bigger = realloc(addrs, size * sizeof(*addrs));
+                        if (!bigger) {
+                                free(addrs);
+                                fclose(f);
+                                return NULL;
+                        }
+                        addrs = bigger;
+                }
+
+                addrs[(*count)++] = addr;
+        }
+
+        fclose(f);
+
+        return addrs;
+}
+
+/* Read a blocklist: one address or prefix per line, with the same comments
+ * as a threat feed. Plain addresses (and /32s) are appended to *addrs, which
+ * may already hold a threat feed; the rest go in a malloc()ed array of
+ * prefixes, ready for the trie. */
+static int read_blocklist(const char *path, unsigned int **addrs, size_t *num_addrs,
+                          struct prefix_key **prefixes, size_t *num_prefixes)
+{
+        FILE *f = fopen(path, "r");
+        size_t addrs_size = *num_addrs;
+        size_t prefixes_size = 0;
+        char line[256];
+        int lineno = 0;
+
+        *prefixes = NULL;
+        *num_prefixes = 0;
+
+        if (!f) {
+                dlog(stderr, INFO, "Failed to open %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                const char *p = line + strspn(line, " \t");
+                unsigned int addr, len = 32;
+
+                lineno++;
+
+                if (*p == '#' || *p == '\n' || *p == '\r' || !*p) {
+                        continue;
+                }
+
+                p = parse_ipv4(p, &addr);
+                if (p && *p == '/') {
+                        p++;
+                        if (*p < '0' || *p > '9') {
+                                p = NULL;
+                        } else {
+                                len = *p++ - '0';
+                                if (*p >= '0' && *p <= '9') {
+                                        len = len * 10 + (*p++ - '0');
+                                }
+                        }
+                }
+
+                if (!p || len > 32 || !strchr(" \t\r\n#", *p)) {
+                        dlog(stderr, INFO, "%s:%d: Invalid address or prefix\n", path, lineno);
+                        goto fail;
+                }
+
+                if (len == 32) {
+                        if (*num_addrs == addrs_size) {
+                                addrs_size = addrs_size ? addrs_size * 2 : 65536;
+                                unsigned int *bigger = realloc(*addrs, addrs_size * sizeof(**addrs));
+                                if (!bigger) {
+                                        goto fail;
+                                }
+                                *addrs = bigger;
+                        }
+
+                        (*addrs)[(*num_addrs)++] = addr;
+                        continue;
+                }
+
+                if (*num_prefixes == prefixes_size) {
+                        prefixes_size = prefixes_size ? prefixes_size * 2 : 4096;
+                        struct prefix_key *bigger = realloc(*prefixes, prefixes_size * sizeof(**prefixes));
+                        if (!bigger) {
+                                goto fail;
+                        }
+                        *prefixes = bigger;
+                }
+
+                /* The trie doesn't care about the host bits, but we'd rather
+                 * not have 10.1.2.3/8 and 10.0.0.0/8 as separate entries. */
+                (*prefixes)[*num_prefixes].prefixlen = len;
+                (*prefixes)[*num_prefixes].addr = htonl(len ? addr & ~0U << (32 - len) : 0);
+                (*num_prefixes)++;
+        }
+
+        fclose(f);
+
+        return 0;
+
+fail:
+        free(*prefixes);
+        *prefixes = NULL;
+        *num_prefixes = 0;
+        fclose(f);
+        return -1;
+}
+
+/* Size the threat maps for entries addresses and prefixes prefixes. This has
+ * to happen between opening and loading the skeleton. */
+static void size_threat_maps(struct context *ctx, struct xdpfilter_bpf *skel, size_t entries, size_t prefixes)
+{
+        if (!entries) {
+                entries = 1;
+        }
+
+        bpf_map__set_max_entries(skel->maps.threatlist, entries);
+        bpf_map__set_max_entries(skel->maps.threat_prefixes, prefixes ? prefixes : 1);
+
+        ctx->threat_queue = libbpf_probe_bpf_map_type(MAP_TYPE_BLOOM_FILTER, NULL) <= 0;
+        if (ctx->threat_queue) {
+                dlog(stdout, DEBUG, "Kernel has no Bloom filter maps, checking the threat list directly\n");
+                bpf_map__set_type(skel->maps.threat_bloom, BPF_MAP_TYPE_QUEUE);
+                bpf_map__set_map_extra(skel->maps.threat_bloom, 0);
+                bpf_map__set_max_entries(skel->maps.threat_bloom, 1);
+        } else {
+                bpf_map__set_max_entries(skel->maps.threat_bloom, entries);
+        }
+}
+
+/* Point the stages program array at the parser stages. Programs that weren't
+ * loaded (SYN cookies, usually) leave their slot empty, and the stage before
+ * just passes the packet. Any slot can be replaced later with a program of our
+ * own, without touching the rest of the pipeline. */
+static int install_stages(struct xdpfilter_bpf *skel)
+{
+        const struct {
+                enum stage stage;
+                struct bpf_program *prog;
+        } table[] = {
+                { STAGE_IPV4, skel->progs.xdp_ipv4 },
+                { STAGE_TCP, skel->progs.xdp_tcp },
+                { STAGE_UDP, skel->progs.xdp_udp },
+                { STAGE_ICMP, skel->progs.xdp_icmp },
+                { STAGE_SYNCOOKIE, skel->progs.xdp_syncookie },
+        };
+        int stages_fd = bpf_map__fd(skel->maps.stages);
+
+        for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+                unsigned int key = table[i].stage;
+                int fd = bpf_program__fd(table[i].prog);
+
+                if (fd < 0) {
+                        continue;
+                }
+
+                if (bpf_map_update_elem(stages_fd, &key, &fd, BPF_ANY)) {
+                        dlog(stderr, INFO, "Failed to install %s: %s\n", bpf_program__name(table[i].prog), strerror(errno));
+                        return -errno;
+                }
+        }
+
+        return 0;
+}
+
+/* Maps that outlive us with --pin-path: the blocks, and the counters worth
+ * keeping. Everything userspace writes at startup anyway is left out, and so
+ * are the threat maps, which are sized to the feed. A pinned map that's
+ * already there gets reused instead of created. */
+static int pin_maps(struct xdpfilter_bpf *skel)
+{
+        /* Only maps whose layout doesn't depend on our enums: a pinned map
+         * is reused as is, so stats or flag_drops pinned by an older build
+         * would be too small for this one. Those counters start over. */
+        struct bpf_map *maps[] = {
+                skel->maps.blacklist,
+                skel->maps.prefix_blacklist,
+                skel->maps.egress_blacklist,
+                skel->maps.gcra,
+                /* A pinned link keeps xdp_prog_simple, but the kernel
+                 * empties a program array once nobody holds it, so the
+                 * stages (and their scratch space) have to be pinned too,
+                 * or every packet would pass between runs. */
+                skel->maps.stages,
+                skel->maps.parse_state,
+        };
+        char path[PATH_MAX];
+
+        if (mkdir(env.pin_path, 0700) && errno != EEXIST) {
+                dlog(stderr, INFO, "Failed to create %s: %s\n", env.pin_path, strerror(errno));
+                return -1;
+        }
+
+        for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+                snprintf(path, sizeof(path), "%s/%s", env.pin_path, bpf_map__name(maps[i]));
+
+                if (bpf_map__set_pin_path(maps[i], path)) {
+                        dlog(stderr, INFO, "Failed to pin %s: %s\n", path, strerror(errno));
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/* With --pin-path, attach through a BPF link pinned next to the maps, which
+ * stays attached after we exit. If a previous run left one, swap our program
+ * into it instead: the kernel replaces the program atomically, so no packet
+ * goes unfiltered during an upgrade. */
+static int attach_xdp_link(struct bpf_program *prog, const struct iface *iface)
+{
+        char path[PATH_MAX];
+        int prog_fd = bpf_program__fd(prog);
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/link_%s", env.pin_path, iface->name);
+
+        fd = bpf_obj_get(path);
+        if (fd >= 0) {
+                int err = bpf_link_update(fd, prog_fd, NULL);
+
+                if (err) {
+                        dlog(stderr, INFO, "Failed to replace the program on %s: %s\n", iface->name, strerror(errno));
+                } else {
+                        dlog(stdout, DEBUG, "Replaced the program on %s\n", iface->name);
+                }
+
+                close(fd);
+                return err;
+        }
+
+        LIBBPF_OPTS(bpf_link_create_opts, opts,
+                .flags = env.mode == XDP_MODE_NATIVE ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE,
+        );
+
+        fd = bpf_link_create(prog_fd, iface->ifindex, BPF_XDP, &opts);
+        if (fd < 0) {
+                dlog(stderr, INFO, "Failed to attach to %s: %s\n", iface->name, strerror(errno));
+                return -1;
+        }
+
+        if (bpf_obj_pin(fd, path)) {
+                dlog(stderr, INFO, "Failed to pin %s: %s\n", path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        dlog(stdout, DEBUG, "Attached to %s\n", iface->name);
+
+        /* The pin holds the link now. */
+        close(fd);
+
+        return 0;
+}
+
+/* Attach prog to one of iface's clsact qdisc hooks, creating the qdisc if
+ * the interface doesn't have one yet. */
+static int attach_tc(struct bpf_program *prog, const struct iface *iface, struct tc_link *link, enum bpf_tc_attach_point point)
+{
+        link->hook.sz = sizeof(link->hook);
+        link->hook.ifindex = iface->ifindex;
+        link->hook.attach_point = point;
+        link->opts.sz = sizeof(link->opts);
+        link->opts.handle = 1;
+        link->opts.priority = 1;
+
+        int err = bpf_tc_hook_create(&link->hook);
+
+        if (err && err != -EEXIST) {
+                dlog(stderr, INFO, "Failed to create clsact qdisc on %s: %s\n", iface->name, strerror(-err));
+                return err;
+        }
+        link->created = !err;
+
+        link->opts.prog_fd = bpf_program__fd(prog);
+
+        /* With --pin-path there may be one of ours left from a previous run,
+         * which the kernel swaps for the new one in place. */
+        if (env.pin_path) {
+                link->opts.flags = BPF_TC_F_REPLACE;
+        }
+
+        err = bpf_tc_attach(&link->hook, &link->opts);
+        if (err) {
+                dlog(stderr, INFO, "Failed to attach TC classifier to %s: %s\n", iface->name, strerror(-err));
+                if (link->created) {
+                        bpf_tc_hook_destroy(&link->hook);
+                }
+                return err;
+        }
+
+        link->attached = true;
+
+        return 0;
+}
+
+/* Remove our classifier, and the qdisc too if we were the ones who made
+ * it; otherwise someone else's filters might be hanging off it. */
+static void detach_tc(struct tc_link *link)
+{
+        if (!link->attached) {
+                return;
+        }
+
+        /* bpf_tc_detach wants just the handle and priority. */
+        link->opts.prog_fd = 0;
+        link->opts.prog_id = 0;
+        link->opts.flags = 0;
+
+        bpf_tc_detach(&link->hook, &link->opts);
+        link->attached = false;
+
+        /* Both hooks at once means the qdisc itself, rather than just the
+         * filters on one hook. */
+        if (link->created) {
+                link->hook.attach_point = BPF_TC_INGRESS | BPF_TC_EGRESS;
+                bpf_tc_hook_destroy(&link->hook);
+        }
+}
+
+/* Set count keys of key_size bytes in fd to 1, in batches where the kernel
+ * supports it and one by one where it doesn't. Maps without batch operations
+ * (LPM tries, for one) fail with the kernel's own ENOTSUPP, which isn't in
+ * errno.h. */
+static int update_batch(int fd, const void *keys, size_t key_size, size_t count, const char *what)
+{
+        static unsigned char ones[THREAT_BATCH];
+        LIBBPF_OPTS(bpf_map_batch_opts, opts);
+        bool batch = true;
+
+        memset(ones, 1, sizeof(ones));
+
+        for (size_t i = 0; i < count; i += THREAT_BATCH) {
+                unsigned int n = count - i < THREAT_BATCH ? count - i : THREAT_BATCH;
+                const char *chunk = (const char *)keys + i * key_size;
+
+                if (batch && bpf_map_update_batch(fd, chunk, ones, &n, &opts)) {
+                        if (errno != EINVAL && errno != ENOTSUP && errno != EOPNOTSUPP && errno != 524) {
+                                dlog(stderr, INFO, "Failed to update %s: %s\n", what, strerror(errno));
+                                return -1;
+                        }
+
+                        batch = false;
+                }
+
+                for (unsigned int j = 0; !batch && j < n; j++) {
+                        if (bpf_map_update_elem(fd, chunk + j * key_size, ones, BPF_ANY)) {
+                                dlog(stderr, INFO, "Failed to update %s: %s\n", what, strerror(errno));
+                                return -1;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+/* Add addresses to the threat list and its Bloom filter. Bloom filters have
+ * no batch operations, so they go one by one. */
+static int load_threats(struct context *ctx, const unsigned int *addrs, size_t count)
+{
+        if (update_batch(ctx->threatlist_fd, addrs, sizeof(*addrs), count, "threat list")) {
+                return -1;
+        }
+
+        /* Without a Bloom filter, the hash is all there is. */
+        if (ctx->threat_queue) {
+                return 0;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+                if (bpf_map_update_elem(ctx->threat_bloom_fd, NULL, &addrs[i], BPF_ANY)) {
+                        dlog(stderr, INFO, "Failed to update threat filter: %s\n", strerror(errno));
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/* Average nanoseconds per run of the XDP program on a bare ACK from saddr,
+ * as measured by the kernel. An ACK goes through every lookup a SYN does
+ * without making an event. */
+static long bench_packet(int prog_fd, unsigned int saddr)
+{
+        unsigned char pkt[54] = {
+                /* Ethernet: zero MACs, IPv4. */
+                [12] = 0x08, [13] = 0x00,
+                /* IPv4: no options, 40 bytes, TTL 64, TCP, 10.0.0.1. */
+                [14] = 0x45, [16] = 0, [17] = 40, [22] = 64, [23] = IPPROTO_TCP,
+                [30] = 10, [31] = 0, [32] = 0, [33] = 1,
+                /* TCP: port 1234 to 80, no options, ACK. */
+                [34] = 0x04, [35] = 0xd2, [36] = 0x00, [37] = 80,
+                [46] = 0x50, [47] = TH_ACK,
+        };
+        unsigned int be = htonl(saddr);
+
+        memcpy(&pkt[26], &be, sizeof(be));
+
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                .data_in = pkt,
+                .data_size_in = sizeof(pkt),
+                .repeat = BENCH_REPEAT,
+        );
+
+        if (bpf_prog_test_run_opts(prog_fd, &opts)) {
+                dlog(stderr, INFO, "Failed to run BPF program: %s\n", strerror(errno));
+                return -1;
+        }
+
+        return opts.duration;
+}
+
+/* Per-packet cost against threat lists of increasing size, for a clean
+ * source and for a listed one, which is dropped, in both the XDP program and
+ * the TC classifier. The list is random addresses, so the clean source only
+ * ever hits the hash on a Bloom false positive. */
+static int run_bench(struct context *ctx, int xdp_fd, int tc_fd, const unsigned int *sizes, int num_sizes)
+{
+        const unsigned int clean = 0xc0000201;  /* 192.0.2.1 */
+        unsigned int seed = (unsigned int)time(NULL) | 1;
+        unsigned int *addrs;
+        size_t loaded = 0;
+
+        addrs = malloc(sizes[num_sizes - 1] * sizeof(*addrs));
+        if (!addrs) {
+                return -1;
+        }
+
+        for (size_t i = 0; i < sizes[num_sizes - 1]; i++) {
+                do {
+                        seed ^= seed << 13;
+                        seed ^= seed >> 17;
+                        seed ^= seed << 5;
+                } while (seed == clean);
+
+                addrs[i] = seed;
+        }
+
+        dlog(stdout, INFO, "%12s %12s %12s %12s %12s\n", "entries", "xdp clean ns", "xdp drop ns", "tc clean ns", "tc drop ns");
+
+        for (int i = 0; i < num_sizes; i++) {
+                long xdp_clean, xdp_listed = -1, tc_clean, tc_listed = -1;
+
+                if (load_threats(ctx, addrs + loaded, sizes[i] - loaded)) {
+                        free(addrs);
+                        return -1;
+                }
+                loaded = sizes[i];
+
+                xdp_clean = bench_packet(xdp_fd, clean);
+                tc_clean = bench_packet(tc_fd, clean);
+                if (loaded) {
+                        xdp_listed = bench_packet(xdp_fd, addrs[0]);
+                        tc_listed = bench_packet(tc_fd, addrs[0]);
+                }
+
+                if (xdp_clean < 0 || tc_clean < 0) {
+                        free(addrs);
+                        return -1;
+                }
+
+                dlog(stdout, INFO, "%12u %12ld %12ld %12ld %12ld\n", sizes[i], xdp_clean, xdp_listed, tc_clean, tc_listed);
+        }
+
+        free(addrs);
+
+        return 0;
+}
+
+/* A TCP segment from 127.0.0.1:sport to 127.0.0.1:dport, behind a zero
+ * Ethernet header. SYNs carry an MSS option, like any real one would. */
+static unsigned int test_packet(unsigned char *pkt, unsigned short sport, unsigned short dport,
+                                unsigned int seq, unsigned int ack, unsigned char flags)
+{
+        unsigned int tcp_len = flags & TH_SYN ? 24 : 20;
+        unsigned int len = 34 + tcp_len;
+        unsigned int be;
+
+        memset(pkt, 0, len);
+        pkt[12] = 0x08;
+        pkt[14] = 0x45;
+        pkt[17] = 20 + tcp_len;
+        pkt[22] = 64;
+        pkt[23] = IPPROTO_TCP;
+        pkt[26] = pkt[30] = 127;
+        pkt[29] = pkt[33] = 1;
+
+        sport = htons(sport);
+        dport = htons(dport);
+        memcpy(&pkt[34], &sport, sizeof(sport));
+        memcpy(&pkt[36], &dport, sizeof(dport));
+        be = htonl(seq);
+        memcpy(&pkt[38], &be, sizeof(be));
+        be = htonl(ack);
+        memcpy(&pkt[42], &be, sizeof(be));
+        pkt[46] = (tcp_len / 4) << 4;
+        pkt[47] = flags;
+        pkt[48] = 0xff;
+        pkt[49] = 0xff;
+
+        if (flags & TH_SYN) {
+                /* MSS 1460. */
+                pkt[54] = 2;
+                pkt[55] = 4;
+                pkt[56] = 0x05;
+                pkt[57] = 0xb4;
+        }
+
+        return len;
+}
+
+/* Run one packet through the XDP program. Returns its verdict, or -1. */
+static int test_run(int prog_fd, unsigned char *pkt, unsigned int len, unsigned char *out, unsigned int *out_len)
+{
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                .data_in = pkt,
+                .data_size_in = len,
+                .data_out = out,
+                .data_size_out = *out_len,
+        );
+
+        if (bpf_prog_test_run_opts(prog_fd, &opts)) {
+                dlog(stderr, INFO, "Failed to run BPF program: %s\n", strerror(errno));
+                return -1;
+        }
+
+        *out_len = opts.data_size_out;
+
+        return opts.retval;
+}
+
+/* SYN cookie mode end to end, through BPF_PROG_TEST_RUN: a SYN to a
+ * listening port has to come back as a SYN-ACK carrying a cookie, an ACK of
+ * that cookie has to pass, and an ACK of anything else has to be dropped.
+ * The listener is ours, on loopback, which is where the kernel runs test
+ * packets. */
+static int run_selftest(int prog_fd)
+{
+        const unsigned short sport = 40000;
+        const unsigned int seq = 1000;
+        struct sockaddr_in addr = {
+                .sin_family = AF_INET,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        socklen_t addr_len = sizeof(addr);
+        unsigned char pkt[64], out[128];
+        unsigned int len, out_len;
+        unsigned short dport, port;
+        unsigned int cookie, ack;
+        int failed = 0;
+        int fd, ret;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1) ||
+            getsockname(fd, (struct sockaddr *)&addr, &addr_len)) {
+                dlog(stderr, INFO, "Failed to set up a listener: %s\n", strerror(errno));
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return -1;
+        }
+
+        dport = ntohs(addr.sin_port);
+
+        len = test_packet(pkt, sport, dport, seq, 0, TH_SYN);
+        out_len = sizeof(out);
+        ret = test_run(prog_fd, pkt, len, out, &out_len);
+        if (ret < 0) {
+                close(fd);
+                return -1;
+        }
+
+        memcpy(&port, &out[34], sizeof(port));
+        memcpy(&cookie, &out[38], sizeof(cookie));
+        memcpy(&ack, &out[42], sizeof(ack));
+        cookie = ntohl(cookie);
+
+        if (ret != XDP_TX || out_len < 58 || out[47] != (TH_SYN | TH_ACK) ||
+            ntohs(port) != dport || ntohl(ack) != seq + 1) {
+                dlog(stdout, INFO, "FAIL: SYN got verdict %d, %u bytes, flags 0x%02x\n", ret, out_len, out[47]);
+                failed++;
+        } else {
+                dlog(stdout, INFO, "ok: SYN answered with a SYN-ACK, cookie %u\n", cookie);
+        }
+
+        len = test_packet(pkt, sport, dport, seq + 1, cookie + 1, TH_ACK);
+        out_len = sizeof(out);
+        ret = test_run(prog_fd, pkt, len, out, &out_len);
+        if (ret != XDP_PASS) {
+                dlog(stdout, INFO, "FAIL: ACK of our cookie got verdict %d\n", ret);
+                failed++;
+        } else {
+                dlog(stdout, INFO, "ok: ACK of our cookie passed\n");
+        }
+
+        len = test_packet(pkt, sport, dport, seq + 1, cookie + 2, TH_ACK);
+        out_len = sizeof(out);
+        ret = test_run(prog_fd, pkt, len, out, &out_len);
+        if (ret != XDP_DROP) {
+                dlog(stdout, INFO, "FAIL: ACK of a wrong cookie got verdict %d\n", ret);
+                failed++;
+        } else {
+                dlog(stdout, INFO, "ok: ACK of a wrong cookie dropped\n");
+        }
+
+        close(fd);
+
+        return failed ? -1 : 0;
+}
+
+/* Does the kernel have the helpers xdp_syncookie needs? If it doesn't, the
+ * verifier would reject it, so we mustn't even try to load it. */
+static bool syncookies_supported(void)
+{
+        return libbpf_probe_bpf_helper(BPF_PROG_TYPE_XDP, HELPER_TCP_RAW_GEN_SYNCOOKIE_IPV4, NULL) > 0;
+}
+
+/* Switch SYN cookie mode on as soon as the aggregate SYN rate goes over
+ * --syncookie-rate, and back off once it has stayed under half of that for a
+ * while. Blocking sources does nothing against a spoofed flood, so this has
+ * to look at every SYN, not per-host counts. Called once per measurement
+ * interval, which is a second. */
+static void update_syncookies(struct context *ctx)
+{
+        unsigned long long syns = read_stat(ctx, STAT_SYN);
+        unsigned long long rate = syns - ctx->last_syns;
+
+        ctx->last_syns = syns;
+
+        if (!env.syncookie_rate) {
+                return;
+        }
+
+        if (!ctx->syncookies && rate > env.syncookie_rate) {
+                dlog(stdout, INFO, "SYN flood detected (%llu SYN/s), enabling SYN cookies\n", rate);
+                ctx->syncookies = true;
+                ctx->calm = 0;
+                write_settings(ctx);
+        } else if (ctx->syncookies) {
+                ctx->calm = rate < env.syncookie_rate / 2 ? ctx->calm + 1 : 0;
+
+                if (ctx->calm == SYNCOOKIE_CALM) {
+                        dlog(stdout, INFO, "SYN flood over (%llu SYN/s), disabling SYN cookies\n", rate);
+                        ctx->syncookies = false;
+                        write_settings(ctx);
+                }
+        }
+}
+
+/* One event from a trace, with its timestamp. */
+struct trace_event {
+        unsigned long long ts;
+        struct event e;
+};
+
+/* What a replay learned about one estimator. */
+struct replay_stats {
+        const char *name;
+        double ingest_ns;
+        double tick_ns;
+        double abs_error;
+        unsigned long samples;
+        unsigned long detections;
+        unsigned long false_positives;
+        unsigned long false_negatives;
+};
+
+static unsigned long long cputime_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+        return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct trace_event *load_trace(const char *path, size_t *count)
+{
+        FILE *f = fopen(path, "r");
+        struct trace_event *events = NULL;
+        size_t size = 0;
+        char line[256];
+
+        *count = 0;
+
+        if (!f) {
+                dlog(stderr, INFO, "Failed to open %s: %s\n", path, strerror(errno));
+                return NULL;
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                unsigned long long sec;
+                char frac[10] = {0};
+                char src[16], dest[16];
+                unsigned short port, flags = 0;
+                unsigned char proto = IPPROTO_TCP;
+                struct in_addr addr;
+
+                if (sscanf(line, "%llu.%9[0-9] %15s %15s %hu %hu %hhu", &sec, frac, src, dest, &port, &flags, &proto) < 5) {
+                        continue;
+                }
+
+                /* Replays only compare the port scan estimators. */
+                if (proto != IPPROTO_TCP || (flags & EVENT_EGRESS)) {
+                        continue;
+                }
+
+                if (*count == size) {
+                        size = size ? size * 2 : 4096;
+                        struct trace_event *bigger = realloc(events, size * sizeof(*events));
+                        if (!bigger) {
+                                free(events);
+                                fclose(f);
+                                return NULL;
+                        }
+                        events = bigger;
+                }
+
+                struct trace_event *t = &events[*count];
+
+                /* Pad the fraction out to nanoseconds. */
+                for (size_t i = strlen(frac); i < 9; i++) {
+                        frac[i] = '0';
+                }
+
+                t->ts = sec * NSEC_PER_SEC + strtoull(frac, NULL, 10);
+                if (!inet_aton(src, &addr)) {
+                        continue;
+                }
+                t->e.host = ntohl(addr.s_addr);
+                if (!inet_aton(dest, &addr)) {
+                        continue;
+                }
+                t->e.dest = ntohl(addr.s_addr);
+                t->e.port = port;
+                t->e.flags = flags;
+                t->e.proto = proto;
+                /* Not from the kernel, so there's no age to measure. */
+                t->e.ts = 0;
+
+                (*count)++;
+        }
+
+        fclose(f);
+
+        return events;
+}
+
+/* Ground truth for a replay: when each host last hit each port. */
+static void exact_add(apr_pool_t *pool, apr_hash_t *exact, const struct trace_event *t)
+{
+        apr_hash_t *ports = apr_hash_get(exact, &t->e.host, sizeof(unsigned int));
+
+        if (!ports) {
+                unsigned int *host_addr = apr_palloc(pool, sizeof(unsigned int));
+                *host_addr = t->e.host;
+
+                ports = apr_hash_make(pool);
+                apr_hash_set(exact, host_addr, sizeof(unsigned int), ports);
+        }
+
+        unsigned long long *last = apr_hash_get(ports, &t->e.port, sizeof(unsigned short));
+
+        if (!last) {
+                unsigned short *port = apr_palloc(pool, sizeof(unsigned short));
+                *port = t->e.port;
+
+                last = apr_palloc(pool, sizeof(unsigned long long));
+                apr_hash_set(ports, port, sizeof(unsigned short), last);
+        }
+
+        *last = t->ts;
+}
+
+/* Exact number of distinct ports a host hit in the last -t seconds, dropping
+ * the ones that have fallen out. */
+static unsigned int exact_count(apr_hash_t *ports, unsigned long long now)
+{
+        unsigned long long horizon = env.time_period * NSEC_PER_SEC;
+        unsigned int count = 0;
+        apr_hash_index_t *hi;
+
+        for (hi = apr_hash_first(NULL, ports); hi; hi = apr_hash_next(hi)) {
+                const void *key;
+                void *val;
+
+                apr_hash_this(hi, &key, NULL, &val);
+
+                if (*(unsigned long long *)val + horizon > now) {
+                        count++;
+                } else {
+                        apr_hash_set(ports, key, sizeof(unsigned short), NULL);
+                }
+        }
+
+        return count;
+}
+
+/* What the estimator currently thinks a host's rate is. */
+static double estimated_rate(struct context *ctx, const void *key)
+{
+        if (env.estimator == DECAY) {
+                struct decay_elem *elem = apr_hash_get(ctx->decay, key, sizeof(unsigned int));
+
+                return elem ? decay_to(elem, ctx->now) : 0;
+        }
+
+        struct element *prev = apr_hash_get(ctx->prev, key, sizeof(unsigned int));
+        struct element *curr = apr_hash_get(ctx->curr, key, sizeof(unsigned int));
+        double rate = 0;
+
+        if (prev) {
+                rate += element_count(prev) * window_weight(ctx);
+        }
+        if (curr) {
+                rate += element_count(curr);
+        }
+
+        return rate;
+}
+
+static void compare_rates(struct context *ctx, apr_hash_t *exact, struct replay_stats *stats)
+{
+        apr_hash_index_t *hi;
+
+        for (hi = apr_hash_first(NULL, exact); hi; hi = apr_hash_next(hi)) {
+                const void *key;
+                void *val;
+
+                apr_hash_this(hi, &key, NULL, &val);
+
+                unsigned int truth = exact_count(val, ctx->now);
+                double rate = estimated_rate(ctx, key);
+
+                if (!truth && !rate) {
+                        continue;
+                }
+
+                stats->samples++;
+                stats->abs_error += fabs(rate - truth);
+
+                if (rate > env.num_packets) {
+                        stats->detections++;
+                        if (truth <= env.num_packets) {
+                                stats->false_positives++;
+                        }
+                } else if (truth > env.num_packets) {
+                        stats->false_negatives++;
+                }
+        }
+}
+
+/* A spoofed SYN flood through the estimator, the way replay feeds it. Every
+ * SYN has a new source, so the sketch fills up with collisions, and that
+ * mustn't get the flood's sources tracked, or get a host that sent one SYN
+ * blocked. A host that really does scan still has to be caught. */
+static int run_sketch_selftest(apr_pool_t *parent)
+{
+        const unsigned int sources = 100000;
+        const unsigned int client = htonl(0xc0a80001);
+        const unsigned int scanner = htonl(0xc0a80002);
+        struct event e = {
+                .dest = htonl(0x0a000001),
+                .port = 80,
+                .proto = IPPROTO_TCP,
+        };
+        apr_pool_t *pool;
+        struct context ctx;
+        unsigned int tracked;
+        double rate;
+        int failed = 0;
+
+        apr_pool_create(&pool, parent);
+
+        if (init_context(&ctx, pool)) {
+                apr_pool_destroy(pool);
+                return -1;
+        }
+
+        ctx.now = ctx.period_start = NSEC_PER_SEC;
+
+        for (unsigned int i = 0; i < sources; i++) {
+                e.host = htonl(0x0b000000 + i);
+                process_event(&ctx, &e, sizeof(e));
+        }
+
+        tracked = apr_hash_count(env.estimator == DECAY ? ctx.decay : ctx.curr);
+        if (tracked > sources / 100) {
+                dlog(stdout, INFO, "FAIL: %u of %u flood sources tracked\n", tracked, sources);
+                failed++;
+        } else {
+                dlog(stdout, INFO, "ok: %u of %u flood sources tracked\n", tracked, sources);
+        }
+
+        e.host = client;
+        process_event(&ctx, &e, sizeof(e));
+
+        rate = estimated_rate(&ctx, &client);
+        if (rate > env.num_packets) {
+                dlog(stdout, INFO, "FAIL: a host with one SYN is at %.1f ports\n", rate);
+                failed++;
+        } else {
+                dlog(stdout, INFO, "ok: a host with one SYN is at %.1f ports\n", rate);
+        }
+
+        e.host = scanner;
+        for (long port = 1; port <= env.num_packets + 16; port++) {
+                e.port = port;
+                process_event(&ctx, &e, sizeof(e));
+        }
+
+        rate = estimated_rate(&ctx, &scanner);
+        if (rate <= env.num_packets) {
+                dlog(stdout, INFO, "FAIL: a host scanning %ld ports is at %.1f\n", env.num_packets + 16, rate);
+                failed++;
+        } else {
+                dlog(stdout, INFO, "ok: a host scanning %ld ports is at %.1f\n", env.num_packets + 16, rate);
+        }
+
+        free_decay(&ctx);
+        apr_pool_destroy(pool);
+
+        return failed ? -1 : 0;
+}
+
+/* Run a whole trace through one estimator, on the trace's clock, with the
+ * measure timer ticking every second and -t rotating the windows just like
+ * the live timers would. Only the estimator's own work is timed. */
+static int replay_one(apr_pool_t *parent, const struct trace_event *events, size_t count, struct replay_stats *stats)
+{
+        apr_pool_t *pool;
+        struct context ctx;
+        apr_hash_t *exact;
+        unsigned long long next_tick, next_swap, start;
+        size_t i = 0;
+
+        apr_pool_create(&pool, parent);
+
+        if (init_context(&ctx, pool)) {
+                apr_pool_destroy(pool);
+                return -1;
+        }
+
+        exact = apr_hash_make_custom(pool, hash_func);
+
+        start = events[0].ts;
+        ctx.now = ctx.period_start = start;
+        next_tick = start + NSEC_PER_SEC;
+        next_swap = start + env.time_period * NSEC_PER_SEC;
+
+        while (i < count) {
+                size_t end = i;
+                unsigned long long begin;
+
+                while (end < count && events[end].ts < next_tick) {
+                        end++;
+                }
+
+                /* Not through handle_event, whose own timing would end up
+                 * in what we measure. */
+                begin = cputime_ns();
+                for (size_t k = i; k < end; k++) {
+                        ctx.now = events[k].ts;
+                        process_event(&ctx, (void *)&events[k].e, sizeof(events[k].e));
+                }
+                stats->ingest_ns += cputime_ns() - begin;
+
+                for (size_t k = i; k < end; k++) {
+                        exact_add(pool, exact, &events[k]);
+                }
+
+                i = end;
+                ctx.now = next_tick;
+
+                begin = cputime_ns();
+                if (next_tick >= next_swap) {
+                        swap_hash(&ctx);
+                        next_swap += env.time_period * NSEC_PER_SEC;
+                }
+                if (env.estimator == DECAY) {
+                        decay_sweep(&ctx, false);
+                }
+                stats->tick_ns += cputime_ns() - begin;
+
+                compare_rates(&ctx, exact, stats);
+
+                next_tick += NSEC_PER_SEC;
+        }
+
+        free_decay(&ctx);
+        apr_pool_destroy(pool);
+
+        return 0;
+}
+
+/* Compare the window and decay estimators on the same trace. */
+static int replay_trace(apr_pool_t *pool, const char *path)
+{
+        enum Estimator estimator = env.estimator;
+        struct replay_stats stats[] = {
+                { .name = "window" },
+                { .name = "decay" },
+        };
+        size_t count;
+        struct trace_event *events = load_trace(path, &count);
+
+        if (!events || !count) {
+                dlog(stderr, INFO, "No events in %s\n", path);
+                free(events);
+                return 1;
+        }
+
+        unsigned long long duration = events[count - 1].ts - events[0].ts;
+        unsigned long ticks = duration / NSEC_PER_SEC + 1;
+
+        dlog(stdout, INFO, "Replaying %zu events over %llus with -t %ld -n %ld\n",
+             count, duration / NSEC_PER_SEC, env.time_period, env.num_packets);
+        dlog(stdout, INFO, "%-10s %16s %14s %14s %11s %10s %10s\n",
+             "estimator", "ingest ns/event", "tick us", "mean abs err", "detections", "false pos", "false neg");
+
+        for (int i = 0; i < 2; i++) {
+                env.estimator = i ? DECAY : WINDOW;
+
+                if (replay_one(pool, events, count, &stats[i])) {
+                        free(events);
+                        return 1;
+                }
+
+                dlog(stdout, INFO, "%-10s %16.1f %14.1f %14.3f %11lu %10lu %10lu\n",
+                     stats[i].name,
+                     stats[i].ingest_ns / count,
+                     stats[i].tick_ns / ticks / 1000,
+                     stats[i].samples ? stats[i].abs_error / stats[i].samples : 0,
+                     stats[i].detections,
+                     stats[i].false_positives,
+                     stats[i].false_negatives);
+        }
+
+        env.estimator = estimator;
+        free(events);
+
+        return 0;
+}
+
+static const char *reason_names[] = { "scan", "flood", "manual" };
+
+/* Changes go to cmdline too, which is what a reload starts over from, so
+ * they last until the config file says otherwise. */
+static const struct {
+        const char *name;
+        long *value;
+        long *base;
+        long min;
+} control_params[CONTROL_PARAM_MAX] = {
+        [CONTROL_NUM_PACKETS] = { "num-packets", &env.num_packets, &cmdline.num_packets, 1 },
+        [CONTROL_NUM_HOSTS] = { "num-hosts", &env.num_hosts, &cmdline.num_hosts, 1 },
+        [CONTROL_PORT_SOURCES] = { "port-sources", &env.port_sources, &cmdline.port_sources, 0 },
+        [CONTROL_PREFIX_PACKETS] = { "prefix-packets", &env.prefix_packets, &cmdline.prefix_packets, 0 },
+        [CONTROL_UDP_PACKETS] = { "udp-packets", &env.udp_packets, &cmdline.udp_packets, 0 },
+        [CONTROL_ICMP_PACKETS] = { "icmp-packets", &env.icmp_packets, &cmdline.icmp_packets, 0 },
+        [CONTROL_CLOSED_WEIGHT] = { "closed-weight", &env.closed_weight, &cmdline.closed_weight, 1 },
+};
+
+static unsigned int control_top(struct context *ctx, struct control_top *out)
+{
+        struct topk_entry entries[TOPK_SIZE];
+        unsigned int n = topk_sorted(ctx->topk, entries);
+
+        for (unsigned int i = 0; i < n; i++) {
+                out[i].host = entries[i].key;
+                out[i].syns = entries[i].count;
+                out[i].error = entries[i].error;
+        }
+
+        return n;
+}
+
+static void control_query(struct context *ctx, unsigned int host, struct control_host *out)
+{
+        struct element *elem = apr_hash_get(ctx->curr, &host, sizeof(unsigned int));
+        unsigned char reasons = 0;
+
+        bpf_map_lookup_elem(ctx->blacklist_fd, &host, &reasons);
+
+        out->host = host;
+        out->ports = elem ? element_count(elem) : 0;
+        out->dests = elem ? element_dest_count(elem) : 0;
+        out->reasons = reasons;
+        out->rate = estimated_rate(ctx, &host);
+}
+
+/* Block or unblock a host or prefix by hand. Manual blocks have a reason of
+ * their own, so the detectors never lift them. */
+static int control_block(struct context *ctx, unsigned int addr, unsigned int prefixlen, bool block)
+{
+        char buff[64] = {0};
+        struct in_addr src;
+
+        if (prefixlen > 32) {
+                return -EINVAL;
+        }
+
+        addr &= prefixlen ? ~0U << (32 - prefixlen) : 0;
+        src.s_addr = htonl(addr);
+        inet_ntop(AF_INET, &src, buff, sizeof(buff));
+
+        if (prefixlen == 32) {
+                if (block) {
+                        if (host_allowed(ctx, addr)) {
+                                return -EPERM;
+                        }
+                        block_host(ctx, addr, BLOCK_MANUAL);
+                } else if (bpf_map_delete_elem(ctx->blacklist_fd, &addr)) {
+                        return -errno;
+                }
+        } else {
+                unsigned char reason = PREFIX_MANUAL;
+                struct prefix_key pkey = {
+                        .prefixlen = prefixlen,
+                        .addr = htonl(addr),
+                };
+
+                if (block ? bpf_map_update_elem(ctx->prefix_blacklist_fd, &pkey, &reason, BPF_ANY) :
+                            bpf_map_delete_elem(ctx->prefix_blacklist_fd, &pkey)) {
+                        return -errno;
+                }
+        }
+
+        dlog(stdout, INFO, "%s %s/%u from the control socket\n", block ? "Blocked" : "Unblocked", buff, prefixlen);
+
+        return 0;
+}
+
+static int control_set(struct context *ctx, unsigned int param, long long value, long long *old)
+{
+        if (param >= CONTROL_PARAM_MAX) {
+                return -EINVAL;
+        }
+
+        *old = *control_params[param].value;
+
+        if (value < control_params[param].min || value > LONG_MAX) {
+                return -ERANGE;
+        }
+
+        *control_params[param].value = value;
+        *control_params[param].base = value;
+
+        /* Flood detection is switched on and off in the XDP program. */
+        if (write_settings(ctx)) {
+                return -EIO;
+        }
+
+        dlog(stdout, INFO, "Set %s to %lld (was %lld) from the control socket\n",
+             control_params[param].name, value, *old);
+
+        return 0;
+}
+
+static int control_binary(void *data, int fd, const struct control_request *req)
+{
+        struct context *ctx = data;
+        struct {
+                struct control_reply reply;
+                union {
+                        struct control_top top[TOPK_SIZE];
+                        struct control_host host;
+                };
+        } out = { 0 };
+        size_t len = sizeof(out.reply);
+
+        switch (req->op) {
+        case CONTROL_TOP:
+                out.reply.count = control_top(ctx, out.top);
+                len += out.reply.count * sizeof(out.top[0]);
+                break;
+        case CONTROL_QUERY:
+                control_query(ctx, req->addr, &out.host);
+                out.reply.count = 1;
+                len += sizeof(out.host);
+                break;
+        case CONTROL_BLOCK:
+        case CONTROL_UNBLOCK:
+                out.reply.status = control_block(ctx, req->addr, req->prefixlen, req->op == CONTROL_BLOCK);
+                break;
+        case CONTROL_GET:
+                if (req->param >= CONTROL_PARAM_MAX) {
+                        out.reply.status = -EINVAL;
+                } else {
+                        out.reply.value = *control_params[req->param].value;
+                }
+                break;
+        case CONTROL_SET:
+                out.reply.status = control_set(ctx, req->param, req->value, &out.reply.value);
+                break;
+        default:
+                out.reply.status = -EINVAL;
+        }
+
+        return control_send(fd, &out, len);
+}
+
+static int find_param(const char *name)
+{
+        for (int i = 0; i < CONTROL_PARAM_MAX; i++) {
+                if (!strcmp(name, control_params[i].name)) {
+                        return i;
+                }
+        }
+
+        return -1;
+}
+
+/* One line of the text protocol, for people with socat. Every reply ends
+ * with "ok" or "error: ...", so scripts know where it stops. */
+static int control_text(void *data, int fd, char *line)
+{
+        struct context *ctx = data;
+        char cmd[16] = "", arg[64] = "", val[32] = "";
+        char out[4096];
+        size_t len = 0;
+        int status = 0;
+
+        line[strcspn(line, "\r")] = '\0';
+        sscanf(line, "%15s %63s %31s", cmd, arg, val);
+
+        if (!strcmp(cmd, "top")) {
+                struct control_top top[TOPK_SIZE];
+                unsigned int n = control_top(ctx, top);
+
+                for (unsigned int i = 0; i < n; i++) {
+                        char buff[64] = {0};
+                        struct in_addr src;
+
+                        src.s_addr = htonl(top[i].host);
+                        inet_ntop(AF_INET, &src, buff, sizeof(buff));
+                        len += snprintf(out + len, sizeof(out) - len, "%s %u %u\n", buff, top[i].syns, top[i].error);
+                }
+        } else if (!strcmp(cmd, "query") || !strcmp(cmd, "block") || !strcmp(cmd, "unblock")) {
+                unsigned int addr, prefixlen;
+
+                if (parse_cidr(arg, &addr, &prefixlen)) {
+                        status = -EINVAL;
+                } else if (cmd[0] == 'q') {
+                        struct control_host host;
+
+                        control_query(ctx, addr, &host);
+                        len += snprintf(out + len, sizeof(out) - len, "ports %u dests %u rate %.2f blocked",
+                                        host.ports, host.dests, host.rate);
+
+                        for (unsigned int i = 0; i < sizeof(reason_names) / sizeof(reason_names[0]); i++) {
+                                if (host.reasons & (1 << i)) {
+                                        len += snprintf(out + len, sizeof(out) - len, " %s", reason_names[i]);
+                                }
+                        }
+
+                        len += snprintf(out + len, sizeof(out) - len, "%s\n", host.reasons ? "" : " no");
+                } else {
+                        status = control_block(ctx, addr, prefixlen, cmd[0] == 'b');
+                }
+        } else if (!strcmp(cmd, "get") || !strcmp(cmd, "set")) {
+                int param = find_param(arg);
+                long long value, old;
+                char *end;
+
+                if (param < 0) {
+                        status = -EINVAL;
+                } else if (cmd[0] == 'g') {
+                        len += snprintf(out + len, sizeof(out) - len, "%ld\n", *control_params[param].value);
+                } else {
+                        errno = 0;
+                        value = strtoll(val, &end, 10);
+                        status = errno || !val[0] || *end ? -EINVAL : control_set(ctx, param, value, &old);
+                }
+        } else {
+                status = -EINVAL;
+        }
+
+        if (status) {
+                len += snprintf(out + len, sizeof(out) - len, "error: %s\n", strerror(-status));
+        } else {
+                len += snprintf(out + len, sizeof(out) - len, "ok\n");
+        }
+
+        return control_send(fd, out, len);
+}
+
+/* Map the ring buffer's position pages. The consumer page is also mapped
+ * writable by libbpf, which moves it along; we only look. */
+static void map_ring(struct context *ctx, int fd, unsigned long size)
+{
+        long page = sysconf(_SC_PAGESIZE);
+        void *consumer = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+        void *producer = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, page);
+
+        if (consumer == MAP_FAILED || producer == MAP_FAILED) {
+                dlog(stderr, INFO, "Failed to map ring buffer positions: %s\n", strerror(errno));
+                if (consumer != MAP_FAILED) {
+                        munmap(consumer, page);
+                }
+                if (producer != MAP_FAILED) {
+                        munmap(producer, page);
+                }
+                return;
+        }
 
-        /* Create a new skiplist to keep track of ports. */
-        struct element *elem = (struct element *) apr_palloc(ctx2->curr_pool, sizeof(struct element));
+        ctx->ring_consumer = consumer;
+        ctx->ring_producer = producer;
+        ctx->ring_size = size;
+}
 
-        elem->list = list;
-        elem->dest = e->dest;
+/* Bytes written to the ring that we haven't consumed yet, including records
+ * still being filled in. */
+static unsigned long ring_backlog(struct context *ctx)
+{
+        unsigned long consumer, producer, backlog;
 
-        if (!val) {
+        if (!ctx->ring_consumer) {
+                return 0;
+        }
 
-                /* Add the port to the skiplist if it doesn't already exist
-                 * (which it absolutely shouldn't).
-                 */
-                apr_skiplist_replace_compare(elem->list, port, (apr_skiplist_freefunc)skiplist_free, (apr_skiplist_compare)skiplist_compare);
+        consumer = __atomic_load_n(ctx->ring_consumer, __ATOMIC_ACQUIRE);
+        producer = __atomic_load_n(ctx->ring_producer, __ATOMIC_ACQUIRE);
+        backlog = producer - consumer;
 
-                /* Add the element as the hash key value. */
-                apr_hash_set(ctx2->curr, host_addr, sizeof(unsigned int), elem);
-        } else {
-                apr_skiplist_replace_compare(((struct element *)val)->list, port, (apr_skiplist_freefunc)skiplist_free, (apr_skiplist_compare)skiplist_compare);
+        if (backlog > ctx->ring_backlog_max) {
+                ctx->ring_backlog_max = backlog;
         }
 
-	return 0;
+        return backlog;
 }
 
-unsigned int hash_func(const char *key, apr_ssize_t *klen)
+/* Once a second: note how full the ring is, and complain if the XDP program
+ * had to throw events away since last time. */
+static void check_ring(struct context *ctx)
 {
-        /* APR expects an unsigned integer hash value. Fortunately, that's
-         * exactly what an IPv4 address is.
-         */
+        unsigned long backlog = ring_backlog(ctx);
+        unsigned long long lost = read_stat(ctx, STAT_EVENTS_LOST);
 
-        return (unsigned int)*key;
-}
-
-int do_hash_print(void *rec, const void *key, apr_ssize_t klen, const void *value)
-{
-        apr_skiplist *list = ((struct element *)value)->list;
-        apr_skiplistnode *node = apr_skiplist_getlist(list);
+        if (ctx->ring_size && backlog > ctx->ring_size / 2) {
+                dlog(stdout, DEBUG, "Ring buffer is %lu%% full\n", backlog * 100 / ctx->ring_size);
+        }
 
-        if (!node) {
-                return 1;
+        if (lost > ctx->last_lost) {
+                dlog(stdout, INFO, "Lost %llu events to a full ring buffer\n", lost - ctx->last_lost);
+                ctx->last_lost = lost;
         }
+}
 
-        struct in_addr src, dest;
+/* Stats map counters, by enum filter_stat. */
+static const char *stat_names[STAT_MAX] = {
+        [STAT_RATE_LIMITED] = "rate_limited",
+        [STAT_SYN] = "syn",
+        [STAT_SYNCOOKIE_SENT] = "syncookie_sent",
+        [STAT_SYNCOOKIE_VALID] = "syncookie_valid",
+        [STAT_SYNCOOKIE_INVALID] = "syncookie_invalid",
+        [STAT_THREAT] = "threat",
+        [STAT_EVENTS_LOST] = "events_lost",
+};
 
-        src.s_addr = htonl(*(unsigned int *)key);
-        dest.s_addr = htonl(((struct element *)value)->dest);
+struct metrics_buf {
+        char data[32768];
+        size_t len;
+};
 
-        dlog(stdout, INFO, "%s -> ", inet_ntoa(src));
-        dlog(stdout, INFO, "%s on ports", inet_ntoa(dest));
+static void emit(struct metrics_buf *buf, const char *fmt, ...)
+{
+        va_list args;
 
-        void *val;
-        void *next;
+        if (buf->len >= sizeof(buf->data) - 1) {
+                return;
+        }
 
-        do {
-                val = apr_skiplist_element(node);
-                dlog(stdout, INFO, " %hu", *(unsigned short *)val);
+        va_start(args, fmt);
+        buf->len += vsnprintf(buf->data + buf->len, sizeof(buf->data) - buf->len, fmt, args);
+        va_end(args);
 
-                /* Curiously, apr_skiplist_next doesn't actually use the list
-                 * pointer.
-                 */
-                next = apr_skiplist_next(list, &node);
-        } while(next);
+        if (buf->len > sizeof(buf->data) - 1) {
+                buf->len = sizeof(buf->data) - 1;
+        }
+}
 
-        dlog(stdout, INFO, "\n");
+/* Run count and time for a program, if it's loaded. */
+static int prog_info(struct bpf_program *prog, struct bpf_prog_info *info)
+{
+        __u32 len = sizeof(*info);
+        int fd = bpf_program__fd(prog);
 
-        return 1;
+        if (fd < 0) {
+                return -1;
+        }
+
+        return bpf_obj_get_info_by_fd(fd, info, &len);
 }
 
-int calculate_rates(void *rec, const void *key, apr_ssize_t klen, const void *value)
+/* Everything we know, in Prometheus' text format. The quantiles are since
+ * startup; rate() over the _sum and _count gives recent averages. */
+static void write_metrics(struct context *ctx, struct xdpfilter_bpf *skel, struct metrics_buf *buf)
 {
-        void *val;
-        struct context *ctx = (struct context *)rec;
-        unsigned int prev_count;
-        unsigned int curr_count;
-        struct itimerspec *curr_value;
-        double rate;
+        static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        struct bpf_program *prog;
 
-        /* Look up the host in the previous time period, if it exists. */
-        val = apr_hash_get(ctx->prev, key, sizeof(unsigned int));
-        prev_count = 0;
+        emit(buf, "# HELP xdpfilter_stage_seconds Time taken by each stage of the userspace loop.\n");
+        emit(buf, "# TYPE xdpfilter_stage_seconds summary\n");
+        for (int i = 0; i < TIME_MAX; i++) {
+                const struct hist *h = &ctx->timings[i];
 
-        if (val) {
-                prev_count = apr_skiplist_size(((struct element *)val)->list);
+                for (unsigned int q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                        emit(buf, "xdpfilter_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                             timing_names[i], quantiles[q], (double)hist_quantile(h, quantiles[q]) / NSEC_PER_SEC);
+                }
+                emit(buf, "xdpfilter_stage_seconds_sum{stage=\"%s\"} %.9f\n", timing_names[i], (double)h->sum / NSEC_PER_SEC);
+                emit(buf, "xdpfilter_stage_seconds_count{stage=\"%s\"} %llu\n", timing_names[i], h->total);
         }
 
-        curr_count = apr_skiplist_size(((struct element *)value)->list);
+        emit(buf, "# HELP xdpfilter_stage_max_seconds Longest single run of each stage.\n");
+        emit(buf, "# TYPE xdpfilter_stage_max_seconds gauge\n");
+        for (int i = 0; i < TIME_MAX; i++) {
+                emit(buf, "xdpfilter_stage_max_seconds{stage=\"%s\"} %.9f\n",
+                     timing_names[i], (double)ctx->timings[i].max / NSEC_PER_SEC);
+        }
 
-        curr_value = malloc(sizeof(*curr_value));
-        timerfd_gettime(ctx->sample_fd, curr_value);
+        const struct hist *age = ctx->event_age;
 
-        rate = prev_count * (((long int)(curr_value->it_value.tv_sec))/60.0) + curr_count;
+        emit(buf, "# HELP xdpfilter_event_age_seconds Time from the XDP or TC program making an event to us handling it.\n");
+        emit(buf, "# TYPE xdpfilter_event_age_seconds summary\n");
+        for (unsigned int q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                emit(buf, "xdpfilter_event_age_seconds{quantile=\"%g\"} %.9f\n",
+                     quantiles[q], (double)hist_quantile(age, quantiles[q]) / NSEC_PER_SEC);
+        }
+        emit(buf, "xdpfilter_event_age_seconds_sum %.9f\n", (double)age->sum / NSEC_PER_SEC);
+        emit(buf, "xdpfilter_event_age_seconds_count %llu\n", age->total);
 
-        void *dummy = malloc(sizeof(void *));
-        int lost = bpf_map_lookup_elem(ctx->blacklist_fd, key, dummy);
+        emit(buf, "# HELP xdpfilter_ringbuf_size_bytes Size of the event ring buffer.\n");
+        emit(buf, "# TYPE xdpfilter_ringbuf_size_bytes gauge\n");
+        emit(buf, "xdpfilter_ringbuf_size_bytes %lu\n", ctx->ring_size);
+        emit(buf, "# HELP xdpfilter_ringbuf_backlog_bytes Bytes in the ring buffer waiting for us.\n");
+        emit(buf, "# TYPE xdpfilter_ringbuf_backlog_bytes gauge\n");
+        emit(buf, "xdpfilter_ringbuf_backlog_bytes %lu\n", ring_backlog(ctx));
+        emit(buf, "# HELP xdpfilter_ringbuf_backlog_max_bytes Largest backlog seen, sampled every second and on every scrape.\n");
+        emit(buf, "# TYPE xdpfilter_ringbuf_backlog_max_bytes gauge\n");
+        emit(buf, "xdpfilter_ringbuf_backlog_max_bytes %lu\n", ctx->ring_backlog_max);
 
-        char buff[64] = {0};
-        time_t now = time(0);
-        strftime (buff, 64, "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
-        
-        if (rate > env.num_packets && lost) {
-                dlog(stdout, INFO, "%s: Port scan detected: ", buff);
-                do_hash_print(rec, key, sizeof(unsigned int), value);
-                bpf_map_update_elem(ctx->blacklist_fd, key, &blocked, BPF_NOEXIST);
+        emit(buf, "# HELP xdpfilter_tracked_hosts Hosts with exact counts in each time period.\n");
+        emit(buf, "# TYPE xdpfilter_tracked_hosts gauge\n");
+        emit(buf, "xdpfilter_tracked_hosts{period=\"previous\"} %u\n", apr_hash_count(ctx->prev));
+        emit(buf, "xdpfilter_tracked_hosts{period=\"current\"} %u\n", apr_hash_count(ctx->curr));
+
+        emit(buf, "# HELP xdpfilter_packets_total Packets counted by the XDP and TC programs.\n");
+        emit(buf, "# TYPE xdpfilter_packets_total counter\n");
+        for (int i = 0; i < STAT_MAX; i++) {
+                emit(buf, "xdpfilter_packets_total{counter=\"%s\"} %llu\n", stat_names[i], read_stat(ctx, i));
         }
 
-        if (rate <= env.num_packets && !lost) {
-                bpf_map_delete_elem(ctx->blacklist_fd, key);
+        emit(buf, "# HELP xdpfilter_flag_drops_total Stealth scan packets dropped, by TCP flag pattern.\n");
+        emit(buf, "# TYPE xdpfilter_flag_drops_total counter\n");
+        for (int i = PATTERN_OK + 1; i < PATTERN_MAX; i++) {
+                emit(buf, "xdpfilter_flag_drops_total{pattern=\"%s\"} %llu\n",
+                     pattern_names[i], read_percpu(ctx->flag_drops_fd, i));
         }
 
-        free(curr_value);
-        free(dummy);
+        /* The kernel only keeps these with kernel.bpf_stats_enabled set,
+         * because timing every run isn't free. */
+        emit(buf, "# HELP xdpfilter_prog_runs_total Runs of each BPF program (needs kernel.bpf_stats_enabled).\n");
+        emit(buf, "# TYPE xdpfilter_prog_runs_total counter\n");
+        bpf_object__for_each_program(prog, skel->obj) {
+                struct bpf_prog_info info = { 0 };
 
-        return 1;
+                if (!prog_info(prog, &info)) {
+                        emit(buf, "xdpfilter_prog_runs_total{prog=\"%s\"} %llu\n",
+                             bpf_program__name(prog), (unsigned long long)info.run_cnt);
+                }
+        }
+
+        /* Every sample of a family has to follow its TYPE line, so this
+         * takes a second pass. */
+        emit(buf, "# HELP xdpfilter_prog_run_seconds_total Time spent in each BPF program (needs kernel.bpf_stats_enabled).\n");
+        emit(buf, "# TYPE xdpfilter_prog_run_seconds_total counter\n");
+        bpf_object__for_each_program(prog, skel->obj) {
+                struct bpf_prog_info info = { 0 };
+
+                if (!prog_info(prog, &info)) {
+                        emit(buf, "xdpfilter_prog_run_seconds_total{prog=\"%s\"} %.9f\n",
+                             bpf_program__name(prog), (double)info.run_time_ns / NSEC_PER_SEC);
+                }
+        }
 }
 
-int make_ghost(void *rec, const void *key, apr_ssize_t klen, const void *value)
+/* Answer a scrape once the request is in. We don't care what was asked for;
+ * there's only one page. */
+static void serve_metrics(struct context *ctx, struct xdpfilter_bpf *skel, struct control_client *client)
 {
-        struct context *ctx = (struct context *)rec;
-        struct element *old_elem = (struct element *)value;
-
-        /* If the prev list has a nonzero length (i.e. we received requests),
-         * create a ghost entry of size 0 so rate calculations work properly.
-         */
-        if (apr_skiplist_size(old_elem->list) > 0) {
-                unsigned int *host_addr = (unsigned int *) apr_palloc(ctx->curr_pool, sizeof(unsigned int));
-                *host_addr = *(unsigned int *)key;
+        static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+        static struct metrics_buf buf;
 
-                struct apr_skiplist *list = (struct apr_skiplist *) apr_palloc(ctx->curr_pool, sizeof(struct apr_skiplist *));
-                struct element *new_elem = (struct element *) apr_palloc(ctx->curr_pool, sizeof(struct element));
+        if (!read_client(client)) {
+                return;
+        }
 
-                apr_skiplist_init(&list, ctx->curr_pool);
+        /* Headers end with a blank line. A request too big for the buffer
+         * gets its answer anyway. */
+        if (client->len < sizeof(client->buf) &&
+            (client->len < 4 || memcmp(client->buf + client->len - 4, "\r\n\r\n", 4))) {
+                return;
+        }
 
-                new_elem->list = list;
-                new_elem->dest = old_elem->dest;
+        memcpy(buf.data, header, sizeof(header) - 1);
+        buf.len = sizeof(header) - 1;
+        write_metrics(ctx, skel, &buf);
 
-                apr_hash_set(ctx->curr, host_addr, sizeof(unsigned int), new_elem);
+        if (control_send_all(client->fd, buf.data, buf.len)) {
+                dlog(stderr, DEBUG, "Gave up on a metrics scrape: %s\n", strerror(errno));
         }
-
-        return 1;
+        drop_client(client);
 }
 
-int swap_hash(struct context *ctx)
+/* Attach to every interface. Through libxdp, this is also what loads the
+ * programs, so the stages can only be installed afterwards. */
+static int attach_all(struct xdpfilter_bpf *skel, struct xdp_program *prog, struct iface *ifaces, int num_ifaces)
 {
-        apr_hash_t *temp;
-        apr_pool_t *temp_pool;
+        int err;
 
-        /* Swap hash tables. */
-        temp = ctx->prev;
-        ctx->prev = ctx->curr;
-        ctx->curr = temp;
+        /* The same programs go on every interface, so they all share one
+         * set of maps: a host blocked for scanning one uplink is blocked on
+         * all of them, and all of their events end up in one ring buffer. */
+        for (int i = 0; i < num_ifaces; i++) {
+                struct iface *iface = &ifaces[i];
 
-        /* Clear the current hash table. */
-        apr_hash_clear(ctx->curr);
+                if (env.tc) {
+                        err = attach_tc(skel->progs.tc_ingress, iface, &iface->ingress, BPF_TC_INGRESS);
+                        if (err) {
+                                return err;
+                        }
 
-        /* Swap pools. */
-        apr_pool_clear(ctx->prev_pool);
+                        dlog(stdout, DEBUG, "Attached to %s as a TC classifier\n", iface->name);
+                } else if (env.pin_path) {
+                        err = attach_xdp_link(skel->progs.xdp_prog_simple, iface);
+                        if (err) {
+                                return err;
+                        }
+                } else {
+                        err = xdp_program__attach(prog, iface->ifindex, env.mode, 0);
+                        if (err) {
+                                dlog(stderr, INFO, "Failed to attach to %s: %s\n", iface->name, strerror(-err));
+                                return err;
+                        }
+                        iface->xdp_attached = true;
 
-        temp_pool = ctx->prev_pool;
-        ctx->prev_pool = ctx->curr_pool;
-        ctx->curr_pool = temp_pool;
+                        dlog(stdout, DEBUG, "Attached to %s at priority %u\n", iface->name, xdp_program__run_prio(prog));
+                }
 
-        /* Create "ghost" entries for rate calculation.
-         * We copy everything non-zero from prev back
-         * into curr and set it to zero.
-         */
-        apr_hash_do((apr_hash_do_callback_fn_t *)make_ghost, (void *)ctx, ctx->prev);
+                /* XDP only sees what comes in, so outbound SYNs need a TC
+                 * program whichever way we attached for ingress. */
+                if (env.egress_packets || env.egress_hosts) {
+                        err = attach_tc(skel->progs.tc_egress, iface, &iface->egress, BPF_TC_EGRESS);
+                        if (err) {
+                                return err;
+                        }
 
-        return 1;
+                        dlog(stdout, DEBUG, "Watching outbound SYNs on %s\n", iface->name);
+                }
+        }
+
+        if (!env.tc && !env.pin_path) {
+                return install_stages(skel);
+        }
+
+        return 0;
 }
 
 int main(int argc, char **argv)
@@ -363,39 +4681,89 @@ int main(int argc, char **argv)
          */
         struct context ctx;
 
-        /* We create two separate pools for the previous and current hash tables
-         * This lets us properly free the memory used by individual hash elements. 
-         */
         apr_pool_create(&pool, NULL);
-        apr_pool_create(&(ctx.prev_pool), NULL);
-        apr_pool_create(&(ctx.curr_pool), NULL);
-
-        /* Create our hash tables. prev is for the previous time period, and
-         * curr is for the current time period. When we pass a time boundary, we
-         * free prev, set prev to curr, and set curr to a new hash table.
-         */
-        apr_hashfunc_t hash_func_cb = hash_func;
-
-        /* We allocate the hash tables themselves from the parent pool. */
-        ctx.prev = apr_hash_make_custom(pool, hash_func_cb);
-        ctx.curr = apr_hash_make_custom(pool, hash_func_cb);
 
 	/* Parse command line arguments and set defaults. */
         env.level = INFO;
         env.num_packets = 3;
+        env.num_hosts = 16;
         env.time_period = 60;
-        env.interface = "eth0";
+        env.num_interfaces = 0;
+        env.sketch_promote = 2;
+        env.port_sources = 0;
+        env.prefix_packets = 0;
+        env.prefix_len = 24;
+        env.per_destination = false;
+        env.num_windows = 0;
+        env.estimator = WINDOW;
+        env.replay = NULL;
+        env.record = NULL;
+        env.syn_rate = 0;
+        env.syn_burst = 5;
+        env.num_rates = 0;
+        env.syncookie_rate = 0;
+        env.port_filter = false;
+        env.closed_weight = 4;
+        env.priority = -1;
+        env.mode = XDP_MODE_SKB;
+        env.tc = false;
+        env.egress_packets = 0;
+        env.egress_hosts = 0;
+        env.pin_path = NULL;
+        env.snapshot = NULL;
+        env.control = NULL;
+        env.config = NULL;
+        env.metrics_port = 0;
+        env.listener_aware = false;
+        env.allowlist_file = NULL;
+        env.threat_file = NULL;
+        env.blocklist_file = NULL;
+        env.bench = false;
+        env.selftest = false;
+        env.udp_packets = 0;
+        env.icmp_packets = 0;
 
 	int err = argp_parse(&argp, argc, argv, 0, NULL, &env);
 	if (err) {
 		return err;
         }
 
-        /* Resolve interface name to ifindex. */
-        unsigned int ifindex = if_nametoindex(env.interface);
-        if (!ifindex) {
-                dlog(stderr, INFO, "Error resolving interface name to index: %s\n", strerror(errno));
-                return errno;
+        cmdline = env;
+
+        if (env.config && read_config(env.config, false)) {
+                return 1;
+        }
+
+        if (check_windows()) {
+                return 1;
+        }
+
+        if (init_context(&ctx, pool)) {
+                return 1;
+        }
+
+        /* Offline mode: no BPF, just the estimators. */
+        if (env.replay) {
+                err = replay_trace(pool, env.replay);
+                apr_pool_destroy(pool);
+                return err;
+        }
+
+        if (!env.num_interfaces) {
+                env.interfaces[env.num_interfaces++] = "eth0";
+        }
+
+        /* Resolve interface names to ifindexes. */
+        struct iface ifaces[MAX_INTERFACES] = { 0 };
+        int num_ifaces = env.bench || env.selftest ? 0 : env.num_interfaces;
+
+        for (int i = 0; i < num_ifaces; i++) {
+                ifaces[i].name = env.interfaces[i];
+                ifaces[i].ifindex = if_nametoindex(ifaces[i].name);
+                if (!ifaces[i].ifindex) {
+                        dlog(stderr, INFO, "Error resolving interface name %s to index: %s\n", ifaces[i].name, strerror(errno));
+                        return errno;
+                }
         }
 
 	/* Set up libbpf errors and debug info callback */
@@ -407,6 +4775,7 @@ int main(int argc, char **argv)
 	/* Cleaner handling of Ctrl-C */
 	signal(SIGINT, sig_handler);
 	signal(SIGTERM, sig_handler);
+        signal(SIGHUP, hup_handler);
 
 	/* Load and verify BPF application */
 	skel = xdpfilter_bpf__open();
@@ -415,12 +4784,183 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	/* Load XDP program from our existing bpf_object struct. */
-        struct xdp_program *prog = xdp_program__from_bpf_obj(skel->obj, "xdp_syn");
-        err = xdp_program__attach(prog, ifindex, XDP_MODE_SKB, 0);
+        /* xdp_syncookie only gets loaded if we're going to use it and the
+         * kernel can verify it. */
+        if (env.syncookie_rate && !syncookies_supported()) {
+                dlog(stderr, INFO, "Kernel has no syncookie helpers, ignoring --syncookie-rate\n");
+                env.syncookie_rate = 0;
+        }
 
-        if (err) {
-                goto cleanup;
+        if (env.syncookie_rate && env.tc) {
+                dlog(stderr, INFO, "SYN cookies need XDP, ignoring --syncookie-rate\n");
+                env.syncookie_rate = 0;
+        }
+
+        /* The estimator doesn't need the kernel at all, so it gets tested
+         * whatever the SYN cookie part does. */
+        int sketch_err = env.selftest ? run_sketch_selftest(pool) : 0;
+
+        if (env.selftest && !syncookies_supported()) {
+                dlog(stderr, INFO, "Kernel has no syncookie helpers, skipping the SYN cookie test\n");
+                xdpfilter_bpf__destroy(skel);
+                apr_pool_destroy(pool);
+                return sketch_err ? 1 : 0;
+        }
+
+        if ((!env.syncookie_rate && !env.selftest) || env.bench) {
+                bpf_program__set_autoload(skel->progs.xdp_syncookie, false);
+        }
+
+        /* The threat maps are sized to fit the feed, so it has to be read
+         * before anything is loaded. */
+        unsigned int *threats = NULL;
+        size_t num_threats = 0;
+        struct prefix_key *prefixes = NULL;
+        size_t num_prefixes = 0;
+
+        if (env.threat_file) {
+                threats = read_threats(env.threat_file, &num_threats);
+                if (!threats) {
+                        xdpfilter_bpf__destroy(skel);
+                        return 1;
+                }
+        }
+
+        /* The blocklist's plain addresses share the threat list, so there's
+         * still only one hash lookup per packet however many files there
+         * are. */
+        if (env.blocklist_file &&
+            read_blocklist(env.blocklist_file, &threats, &num_threats, &prefixes, &num_prefixes)) {
+                free(threats);
+                xdpfilter_bpf__destroy(skel);
+                return 1;
+        }
+
+        if (env.bench) {
+                static const unsigned int sizes[] = { 0, 1000, 10000, 100000, 1000000, 4000000 };
+                int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+                size_threat_maps(&ctx, skel, sizes[num_sizes - 1], 0);
+
+                err = xdpfilter_bpf__load(skel);
+                if (!err) {
+                        err = install_stages(skel);
+                }
+
+                /* For threat_queue, which decides how sources are looked
+                 * up. */
+                if (!err) {
+                        ctx.settings_fd = bpf_map__fd(skel->maps.settings);
+                        err = write_settings(&ctx);
+                }
+
+                if (!err) {
+                        ctx.threat_bloom_fd = bpf_map__fd(skel->maps.threat_bloom);
+                        ctx.threatlist_fd = bpf_map__fd(skel->maps.threatlist);
+                        err = run_bench(&ctx, bpf_program__fd(skel->progs.xdp_prog_simple),
+                                        bpf_program__fd(skel->progs.tc_ingress), sizes, num_sizes);
+                }
+
+                free(threats);
+                free(prefixes);
+                xdpfilter_bpf__destroy(skel);
+                apr_pool_destroy(pool);
+                return err ? 1 : 0;
+        }
+
+        if (env.selftest) {
+                size_threat_maps(&ctx, skel, 0, 0);
+
+                err = xdpfilter_bpf__load(skel);
+                if (!err) {
+                        err = install_stages(skel);
+                }
+
+                if (!err) {
+                        ctx.settings_fd = bpf_map__fd(skel->maps.settings);
+                        ctx.syncookies = true;
+                        err = write_settings(&ctx);
+                }
+
+                if (!err) {
+                        err = run_selftest(bpf_program__fd(skel->progs.xdp_prog_simple));
+                }
+
+                free(threats);
+                free(prefixes);
+                xdpfilter_bpf__destroy(skel);
+                apr_pool_destroy(pool);
+                return err || sketch_err ? 1 : 0;
+        }
+
+        size_threat_maps(&ctx, skel, num_threats, num_prefixes);
+
+        struct xdp_program *prog = NULL;
+        struct control control = { .fd = -1 };
+        struct control metrics = { .fd = -1 };
+        bool warm = false;
+
+        if (env.pin_path) {
+                char path[PATH_MAX];
+
+                snprintf(path, sizeof(path), "%s/%s", env.pin_path, bpf_map__name(skel->maps.blacklist));
+                warm = !access(path, F_OK);
+
+                err = pin_maps(skel);
+                if (err) {
+                        goto cleanup;
+                }
+
+                /* Pinned links go straight to the kernel, without libxdp's
+                 * dispatcher. */
+                if (!env.tc && (env.priority >= 0 || env.chain_set)) {
+                        dlog(stderr, INFO, "No dispatcher with --pin-path, ignoring --priority and --chain\n");
+                }
+        }
+
+        if (env.tc || env.pin_path) {
+                err = xdpfilter_bpf__load(skel);
+                if (err) {
+                        dlog(stderr, INFO, "Failed to load BPF skeleton\n");
+                        goto cleanup;
+                }
+
+        } else {
+                /* Load XDP program from our existing bpf_object struct.
+                 * libxdp puts it behind its dispatcher, so other XDP
+                 * programs (a load balancer, say) can share the interface,
+                 * running after us in priority order. */
+                prog = xdp_program__from_bpf_obj(skel->obj, "xdp_syn");
+
+                if (env.priority >= 0) {
+                        xdp_program__set_run_prio(prog, env.priority);
+                }
+
+                if (env.chain_set) {
+                        for (unsigned int i = 0; i <= XDP_REDIRECT; i++) {
+                                xdp_program__set_chain_call_enabled(prog, i, env.chain & (1U << i));
+                        }
+                }
+        }
+
+        /* libxdp loads the programs as it attaches them, so nothing can be
+         * filled in before. Otherwise, everything is in place before the
+         * first packet reaches us, which matters most when we replace a
+         * pinned program that's been filtering all along. */
+        if (!env.tc && !env.pin_path) {
+                err = attach_all(skel, prog, ifaces, num_ifaces);
+                if (err) {
+                        goto cleanup;
+                }
+        }
+
+        if (env.record) {
+                ctx.record = fopen(env.record, "a");
+                if (!ctx.record) {
+                        err = -errno;
+                        dlog(stderr, INFO, "Failed to open %s: %s\n", env.record, strerror(errno));
+                        goto cleanup;
+                }
         }
 
 	/* Set up ring buffer. */
@@ -433,6 +4973,8 @@ int main(int argc, char **argv)
 
         int ringbuf_fd = ring_buffer__epoll_fd(rb);
 
+        map_ring(&ctx, bpf_map__fd(skel->maps.ringbuf), bpf_map__max_entries(skel->maps.ringbuf));
+
         struct epoll_event ev, measure_ev, sample_ev, events[MAX_EVENTS];
 
         int nfds, epollfd;
@@ -456,7 +4998,82 @@ int main(int argc, char **argv)
         int measure_fd = timerfd_create(CLOCK_MONOTONIC, 0);
 
         ctx.sample_fd = sample_fd;
+        ctx.allowlist_fd = bpf_map__fd(skel->maps.allowlist);
         ctx.blacklist_fd = bpf_map__fd(skel->maps.blacklist);
+        ctx.egress_blacklist_fd = bpf_map__fd(skel->maps.egress_blacklist);
+        ctx.prefix_blacklist_fd = bpf_map__fd(skel->maps.prefix_blacklist);
+        ctx.settings_fd = bpf_map__fd(skel->maps.settings);
+        ctx.host_rates_fd = bpf_map__fd(skel->maps.host_rates);
+        ctx.prefix_rates_fd = bpf_map__fd(skel->maps.prefix_rates);
+        ctx.stats_fd = bpf_map__fd(skel->maps.stats);
+        ctx.port_policy_fd = bpf_map__fd(skel->maps.port_policy);
+        ctx.flag_policy_fd = bpf_map__fd(skel->maps.flag_policy);
+        ctx.flag_drops_fd = bpf_map__fd(skel->maps.flag_drops);
+
+        ctx.syncookies = false;
+        ctx.last_syns = read_stat(&ctx, STAT_SYN);
+
+        if (apply_settings(&ctx, NULL)) {
+                err = -1;
+                goto cleanup;
+        }
+
+        if (env.allowlist_file && load_allowlist(&ctx, env.allowlist_file)) {
+                err = -1;
+                goto cleanup;
+        }
+
+        /* Snapshots only cover the two-period window. */
+        unsigned long long resume = 0;
+
+        if (env.snapshot && env.estimator == WINDOW) {
+                resume = load_snapshot(&ctx, env.snapshot);
+        }
+
+        if (warm) {
+                adopt_blocks(&ctx);
+        }
+
+        if (threats || prefixes) {
+                unsigned long long start = monotonic_ns();
+
+                ctx.threat_bloom_fd = bpf_map__fd(skel->maps.threat_bloom);
+                ctx.threatlist_fd = bpf_map__fd(skel->maps.threatlist);
+                ctx.threat_prefixes_fd = bpf_map__fd(skel->maps.threat_prefixes);
+
+                err = load_threats(&ctx, threats, num_threats);
+                if (!err) {
+                        err = update_batch(ctx.threat_prefixes_fd, prefixes, sizeof(*prefixes),
+                                           num_prefixes, "threat prefixes");
+                }
+
+                free(threats);
+                threats = NULL;
+                free(prefixes);
+                prefixes = NULL;
+
+                if (err) {
+                        goto cleanup;
+                }
+
+                dlog(stdout, INFO, "Loaded %zu threat list addresses and %zu prefixes in %llu ms\n",
+                     num_threats, num_prefixes, (monotonic_ns() - start) / 1000000);
+        }
+
+        /* Stages, then the entry program, so the pipeline is complete the
+         * moment it replaces a pinned one. The stages table is pinned too,
+         * so installing our stages is what switches the old entry program
+         * over to them. */
+        if (env.tc || env.pin_path) {
+                err = env.tc ? 0 : install_stages(skel);
+                if (!err) {
+                        err = attach_all(skel, prog, ifaces, num_ifaces);
+                }
+
+                if (err) {
+                        goto cleanup;
+                }
+        }
        
         sample_ev.events = EPOLLIN;
         sample_ev.data.fd = sample_fd;
@@ -493,14 +5110,52 @@ int main(int argc, char **argv)
                 .it_value = measure_ts
         };
 
+        struct control_handler handler = {
+                .binary = control_binary,
+                .text = control_text,
+                .arg = &ctx,
+        };
+
+        if (env.control && open_control(&control, env.control, epollfd, &handler)) {
+                dlog(stderr, INFO, "Failed to listen on %s: %s\n", env.control, strerror(errno));
+                goto cleanup;
+        }
+
+        if (env.metrics_port && open_metrics(&metrics, env.metrics_port, epollfd)) {
+                dlog(stderr, INFO, "Failed to listen on port %ld: %s\n", env.metrics_port, strerror(errno));
+                goto cleanup;
+        }
+
+        /* A restored time period is already partly over. */
+        if (resume) {
+                unsigned long long left = env.time_period * NSEC_PER_SEC - resume;
+
+                sample_its.it_value.tv_sec = left / NSEC_PER_SEC;
+                sample_its.it_value.tv_nsec = left % NSEC_PER_SEC;
+        }
+
         /* Arm the timers. */
         timerfd_settime(sample_fd, 0, &sample_its, NULL);
         timerfd_settime(measure_fd, 0, &measure_its, NULL);
+        ctx.now = monotonic_ns();
+        ctx.period_start = ctx.now - resume;
 
         while (!exiting) {
                nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
                if (nfds == -1) {
-                       goto cleanup;
+                       /* A signal. If it was SIGINT, the loop ends
+                        * normally, and the snapshot gets saved. */
+                       if (errno != EINTR) {
+                               goto cleanup;
+                       }
+                       nfds = 0;
+               }
+
+               ctx.now = monotonic_ns();
+
+               if (reload) {
+                       reload = false;
+                       reload_config(&ctx, sample_fd);
                }
 
                for (int n = 0; n < nfds; ++n) {
@@ -512,25 +5167,114 @@ int main(int argc, char **argv)
                        } else if (events[n].data.fd == sample_fd) {
                                /* Every time period, swap hash tables. */
                                uint64_t buf;
+                               unsigned long long start = monotonic_ns();
+
                                err = swap_hash(&ctx);
+                               record_time(&ctx, TIME_SWAP_HASH, start);
                                read(events[n].data.fd, &buf, sizeof(uint64_t));
                        } else if (events[n].data.fd == measure_fd) {
                                /* Calculate rates. */
                                uint64_t buf;
+                               unsigned long long start = monotonic_ns();
+
                                read(events[n].data.fd, &buf, sizeof(uint64_t));
 
-                               apr_hash_do((apr_hash_do_callback_fn_t *)calculate_rates, (void *)&ctx, ctx.curr);
+                               if (env.estimator == DECAY) {
+                                       decay_sweep(&ctx, true);
+                               } else {
+                                       apr_hash_do((apr_hash_do_callback_fn_t *)calculate_rates, (void *)&ctx, ctx.curr);
+                                       for (int i = 0; i < ctx.num_windows; i++) {
+                                               apr_hash_do((apr_hash_do_callback_fn_t *)calculate_window_rates, (void *)&ctx, ctx.windows[i].curr);
+                                       }
+                               }
+                               apr_hash_do((apr_hash_do_callback_fn_t *)calculate_port_rates, (void *)&ctx, ctx.port_curr);
+                               apr_hash_do((apr_hash_do_callback_fn_t *)calculate_prefix_rates, (void *)&ctx, ctx.prefix_curr);
+                               expire_prefixes(&ctx);
+                               judge_floods(&ctx);
+                               judge_egress(&ctx);
+                               update_syncookies(&ctx);
+                               record_time(&ctx, TIME_MEASURE, start);
+                               check_ring(&ctx);
+
+                               if (env.snapshot && env.estimator == WINDOW) {
+                                       start = monotonic_ns();
+                                       save_snapshot(&ctx, env.snapshot);
+                                       record_time(&ctx, TIME_SNAPSHOT, start);
+                               }
+                       } else if (events[n].data.fd == control.fd) {
+                               accept_control(&control);
+                       } else if (events[n].data.fd == metrics.fd) {
+                               accept_control(&metrics);
+                       } else {
+                               struct control_client *client = find_client(&control, events[n].data.fd);
+
+                               if (client) {
+                                       serve_control(&control, client);
+                               } else if ((client = find_client(&metrics, events[n].data.fd))) {
+                                       serve_metrics(&ctx, skel, client);
+                               }
                        }
                }
         }
 
+        if (env.snapshot && env.estimator == WINDOW) {
+                ctx.now = monotonic_ns();
+                save_snapshot(&ctx, env.snapshot);
+        }
+
+        dlog(stdout, DEBUG, "Rate limited %llu SYNs\n", read_stat(&ctx, STAT_RATE_LIMITED));
+        dlog(stdout, DEBUG, "Lost %llu events to a full ring buffer, with a backlog of up to %lu bytes\n",
+             read_stat(&ctx, STAT_EVENTS_LOST), ctx.ring_backlog_max);
+        dlog(stdout, DEBUG, "Dropped %llu packets from the threat list\n", read_stat(&ctx, STAT_THREAT));
+        dlog(stdout, DEBUG, "Sent %llu SYN cookies, %llu came back valid, %llu ACKs dropped\n",
+             read_stat(&ctx, STAT_SYNCOOKIE_SENT), read_stat(&ctx, STAT_SYNCOOKIE_VALID),
+             read_stat(&ctx, STAT_SYNCOOKIE_INVALID));
+
+        for (int i = PATTERN_OK + 1; i < PATTERN_MAX; i++) {
+                if (env.drop_flags[i]) {
+                        dlog(stdout, DEBUG, "Dropped %llu %s scan packets\n", read_percpu(ctx.flag_drops_fd, i), pattern_names[i]);
+                }
+        }
+
 cleanup:
 	/* Clean up */
+        close_control(&control);
+        close_control(&metrics);
 	ring_buffer__free(rb);
+        /* Pinned, everything stays where it is for the next run. Removing
+         * the pin directory takes it all down. */
+        if (env.pin_path) {
+                dlog(stdout, INFO, "Leaving everything attached, pinned in %s\n", env.pin_path);
+                num_ifaces = 0;
+        }
+
+        for (int i = 0; i < num_ifaces; i++) {
+                struct iface *iface = &ifaces[i];
+
+                if (iface->xdp_attached) {
+                        /* Only takes us out of the dispatcher; anything
+                         * else on the interface keeps running. */
+                        xdp_program__detach(prog, iface->ifindex, env.mode, 0);
+                }
+
+                /* Egress first: if we made the qdisc on the ingress side,
+                 * taking that down takes the egress filter with it. */
+                detach_tc(&iface->egress);
+                detach_tc(&iface->ingress);
+        }
+
+        if (prog) {
+                xdp_program__close(prog);
+        }
 	xdpfilter_bpf__destroy(skel);
-        xdp_program__detach(prog, ifindex, XDP_MODE_SKB, 0);
-        xdp_program__close(prog);
 
+        if (ctx.record) {
+                fclose(ctx.record);
+        }
+
+        free(threats);
+        free(prefixes);
+        free_decay(&ctx);
         apr_pool_destroy(pool);
 
 	return err < 0 ? -err : 0;
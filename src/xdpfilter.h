@@ -3,17 +3,138 @@
 #define __XDPFILTER_H
 
 /* Event struct used for ringbuffer events. All values are in host byte
- * order. */
+ * order. port is the destination port for TCP and UDP, and zero for ICMP. */
 struct event {
 	unsigned int host;
         unsigned int dest;
         unsigned short int port;
+        /* enum event_flags */
+        unsigned short int flags;
+        /* IPPROTO_TCP for SYNs, IPPROTO_UDP or IPPROTO_ICMP for floods. */
+        unsigned char proto;
+        /* bpf_ktime_get_ns() when the event was made, which is
+         * CLOCK_MONOTONIC, for measuring how long it sat in the ring. */
+        unsigned long long ts;
+};
+
+enum event_flags {
+        /* The port is never legitimately open, so this SYN is a probe. */
+        EVENT_CLOSED = 1,
+        /* Something is listening on the port. Only set with
+         * settings.listener_aware. */
+        EVENT_LISTENER = 2,
+        /* An outbound SYN, from one of our hosts, seen by tc_egress. */
+        EVENT_EGRESS = 4,
+};
+
+/* Ports of interest, as bitmaps over all 65536 ports: port_policy[port / 32]
+ * covers ports with bit port % 32. */
+#define PORT_POLICY_ENTRIES (65536 / 32)
+
+struct port_policy {
+        /* Services we protect. */
+        unsigned int protect;
+        /* Honeypot ports nothing legitimate connects to. */
+        unsigned int closed;
+};
+
+/* Key for the LPM trie maps. Unlike everywhere else, the address is in
+ * network byte order, because the trie matches prefixes byte by byte. */
+struct prefix_key {
+        unsigned int prefixlen;
+        unsigned int addr;
+};
+
+/* Why a prefix is in prefix_blacklist. Userspace only expires the ones it
+ * added itself. */
+enum prefix_reason {
+        PREFIX_DYNAMIC = 1,
+        PREFIX_MANUAL = 2,
+};
+
+/* Why a host is in blacklist, as a bitmask. Each detector only clears its own
+ * bit, and the host is unblocked once none are left. */
+enum block_reason {
+        BLOCK_SCAN = 1,
+        BLOCK_FLOOD = 2,
+        BLOCK_MANUAL = 4,
+};
+
+/* A per-source SYN rate for the XDP program's GCRA, in nanoseconds: one SYN
+ * is allowed every interval, with up to burst worth of SYNs arriving early.
+ * An interval of zero means no limit. */
+struct rate_limit {
+        unsigned long long interval;
+        unsigned long long burst;
+};
+
+/* Runtime settings for the XDP program, in the single entry of the
+ * settings map. */
+struct settings {
+        /* Applies to sources without a rate of their own. */
+        struct rate_limit syn_rate;
+        /* Answer SYNs with SYN cookies instead of passing them up. Set by
+         * userspace while the aggregate SYN rate is over --syncookie-rate. */
+        unsigned int syncookies;
+        /* Only SYNs to protected or closed ports generate events. */
+        unsigned int port_filter;
+        /* Look up the listening socket for every SYN we report. */
+        unsigned int listener_aware;
+        /* Report UDP packets and ICMP echo requests, for flood detection. */
+        unsigned int udp_floods;
+        unsigned int icmp_floods;
+        /* threat_bloom is a stand-in, on kernels without Bloom filters, so
+         * every source goes straight to threatlist. */
+        unsigned int threat_queue;
+};
+
+/* Data-plane counters, indexes into the per-CPU stats map. */
+enum filter_stat {
+        STAT_RATE_LIMITED,
+        /* Every SYN that got past the blacklists, for the aggregate rate. */
+        STAT_SYN,
+        STAT_SYNCOOKIE_SENT,
+        STAT_SYNCOOKIE_VALID,
+        STAT_SYNCOOKIE_INVALID,
+        STAT_THREAT,
+        /* Events we couldn't report because the ring buffer was full. */
+        STAT_EVENTS_LOST,
+        STAT_MAX,
+};
+
+/* Stealth scan patterns, by TCP flags byte. The flag_policy map holds the
+ * pattern to drop for each of the 256 possible bytes, or PATTERN_OK to let
+ * it through, and flag_drops counts drops per pattern. */
+enum flag_pattern {
+        PATTERN_OK,
+        PATTERN_NULL,
+        PATTERN_FIN,
+        PATTERN_XMAS,
+        PATTERN_SYNFIN,
+        PATTERN_SYNRST,
+        /* Anything else no TCP stack would send. */
+        PATTERN_ILLEGAL,
+        PATTERN_MAX,
+};
+
+/* Slots in the stages program array. The entry program parses Ethernet and
+ * tail calls its way down from there. */
+enum stage {
+        STAGE_IPV4,
+        STAGE_TCP,
+        STAGE_UDP,
+        STAGE_ICMP,
+        STAGE_SYNCOOKIE,
+        STAGE_MAX,
 };
 
 /* Redefine all the macros we need because including headers like
  * linux/if_ether.h causes typedef collisions. For now, copying and pasting is
  * the accepted solution, per the author of libbpf:
  * https://www.spinics.net/lists/bpf/msg39443.html */
+#define ETH_P_IP	0x0800		/* Internet Protocol packet	*/
+#define ETH_P_8021Q	0x8100          /* 802.1Q VLAN Extended Header  */
 #define ETH_P_IPV6	0x86DD		/* IPv6 over bluebook		*/
+#define ETH_P_8021AD	0x88A8          /* 802.1ad Service VLAN		*/
 
 #endif /* __XDPFILTER_H */